@@ -8,10 +8,12 @@
 */
 
 #include <string.h>
+#include <errno.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 
 #include <driver/uart.h>
 #include <esp_wifi.h>
@@ -20,25 +22,320 @@
 #include <nvs_flash.h>
 
 #include <lwip/sockets.h>
+#include <lwip/tcp.h>
+#include <lwip/tcpip.h>
+#ifndef CONFIG_BRIDGE_NETCONN
+#include <lwip/priv/sockets_priv.h>
+#endif
 
 #include "wifi.h"
-
-#define UART_BUF_SIZE 1024
+#include "capture.h"
+#include "mem.h"
+#include "stats.h"
+#include "fault.h"
+#include "trace.h"
+#include "tls.h"
+#include "filter.h"
+#include "selftest.h"
+#include "link.h"
+#ifdef CONFIG_BRIDGE_NETCONN
+#include "nc.h"
+#endif
+
+#define UART_BUF_SIZE BRIDGE_UART_BUF_SIZE
 #define SRV_PORT 8888
 
+#define KEEPALIVE_IDLE CONFIG_BRIDGE_KEEPALIVE_IDLE
+#define KEEPALIVE_INTERVAL CONFIG_BRIDGE_KEEPALIVE_INTERVAL
+#define KEEPALIVE_COUNT CONFIG_BRIDGE_KEEPALIVE_COUNT
+#define IDLE_TIMEOUT CONFIG_BRIDGE_IDLE_TIMEOUT
+
+#define AUTH_TIMEOUT_MS 2000
+#define TAKEOVER_WAIT_MS 500
+
+#ifdef CONFIG_BRIDGE_TAKEOVER_REJECT
+#define TAKEOVER false
+#else
+#define TAKEOVER true
+#endif
+
+TASK_DEFINE(bridge, BRIDGE_STACK_MAIN);
+TASK_DEFINE(u2w, BRIDGE_STACK_U2W);
+TASK_DEFINE(w2u, BRIDGE_STACK_W2U);
+
+#ifdef CONFIG_BRIDGE_FAULT_INJECT
+/* Wake up now and then to serve injected test patterns */
+#define UART_EVENT_WAIT (100 / portTICK_PERIOD_MS)
+#else
+#define UART_EVENT_WAIT portMAX_DELAY
+#endif
+
+/* Bridge client connection, a netconn or a socket */
+#ifdef CONFIG_BRIDGE_NETCONN
+typedef struct netconn *conn_t;
+#define CONN_NONE NULL
+#else
+typedef int conn_t;
+#define CONN_NONE (-1)
+#endif
+
 static QueueHandle_t uart_queue;
+#ifndef CONFIG_BRIDGE_NETCONN
 static char rx_buff[UART_BUF_SIZE];
+#endif
 static uint8_t tx_buff[UART_BUF_SIZE];
 
+/*
+ * The bridge client connection is shared by the u2w and w2u tasks. Each of
+ * them holds a reference while it is inside send() or recv(). A failing
+ * task only shuts the socket down, which wakes up the other one; the last
+ * reference closes it. A socket number is therefore never reused while a
+ * task still uses it, and no new client is accepted before the old one is
+ * fully closed.
+ */
+static struct {
+	conn_t conn;
+	struct tls_conn *tls;	/* NULL for plain TCP clients */
+	int refs;
+	bool dead;
+	TickType_t active;	/* Tick of the last data in either direction */
+	uint8_t nrtx;		/* Retransmissions seen by the last send */
+} g_client = { .conn = CONN_NONE };
+
+static SemaphoreHandle_t g_client_lock;
+SEMAPHORE_DEFINE(g_client_lock);
+
+static void conn_shutdown(conn_t conn, bool reset)
+{
+#ifdef CONFIG_BRIDGE_NETCONN
+	nc_shutdown(conn, reset);
+#else
+	if (reset) {
+		struct linger lng = { .l_onoff = 1, .l_linger = 0 };
+		setsockopt(conn, SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
+	}
+
+	shutdown(conn, SHUT_RDWR);
+#endif
+}
+
+static void conn_close(conn_t conn)
+{
+#ifdef CONFIG_BRIDGE_NETCONN
+	nc_close(conn);
+#else
+	close(conn);
+#endif
+}
+
+static conn_t client_get(void)
+{
+	conn_t conn = CONN_NONE;
+
+	xSemaphoreTake(g_client_lock, portMAX_DELAY);
+	if (g_client.conn != CONN_NONE && !g_client.dead) {
+		g_client.refs++;
+		conn = g_client.conn;
+	}
+	xSemaphoreGive(g_client_lock);
+
+	return conn;
+}
+
+/* Called with g_client_lock held */
+static void client_kill(bool reset)
+{
+	if (!g_client.dead) {
+		g_client.dead = true;
+		conn_shutdown(g_client.conn, reset);
+	}
+
+	if (g_client.refs)
+		return;
+
+	tls_free(g_client.tls);
+	conn_close(g_client.conn);
+	g_client.conn = CONN_NONE;
+	g_client.tls = NULL;
+	wifi_bridge_active(false);
+}
+
+static void client_put(bool failed)
+{
+	bool reset = fault_take_rst();
+
+	xSemaphoreTake(g_client_lock, portMAX_DELAY);
+	g_client.refs--;
+	if (failed || reset || g_client.dead)
+		client_kill(reset);
+	xSemaphoreGive(g_client_lock);
+}
+
+static bool client_set(conn_t conn, struct tls_conn *tls)
+{
+	bool ok = false;
+
+	xSemaphoreTake(g_client_lock, portMAX_DELAY);
+	if (g_client.conn == CONN_NONE) {
+		g_client.conn = conn;
+		g_client.tls = tls;
+		g_client.refs = 0;
+		g_client.dead = false;
+		g_client.active = xTaskGetTickCount();
+		g_client.nrtx = 0;
+		ok = true;
+	}
+	xSemaphoreGive(g_client_lock);
+
+	return ok;
+}
+
+/* Drop the current client and wait until both tasks let go of it */
+static bool client_takeover(conn_t conn, struct tls_conn *tls)
+{
+	int wait = TAKEOVER_WAIT_MS / 10;
+
+	xSemaphoreTake(g_client_lock, portMAX_DELAY);
+	if (g_client.conn != CONN_NONE)
+		client_kill(false);
+	xSemaphoreGive(g_client_lock);
+
+	while (!client_set(conn, tls)) {
+		if (!wait--)
+			return false;
+
+		vTaskDelay(10 / portTICK_PERIOD_MS);
+	}
+
+	return true;
+}
+
+#ifdef CONFIG_BRIDGE_NETCONN
+static ssize_t conn_send(conn_t conn, struct tls_conn *tls, const void *buf,
+						 size_t len)
+{
+	return nc_send(conn, buf, len);
+}
+#else
+static ssize_t conn_send(conn_t conn, struct tls_conn *tls, const void *buf,
+						 size_t len)
+{
+	if (tls)
+		return tls_send(tls, buf, len);
+
+	return send(conn, buf, len, 0);
+}
+
+static ssize_t conn_recv(conn_t conn, struct tls_conn *tls, void *buf,
+						 size_t len)
+{
+	if (tls)
+		return tls_recv(tls, buf, len);
+
+	return recv(conn, buf, len, 0);
+}
+#endif
+
+struct nrtx_call {
+	struct tcpip_api_call_data call;
+	conn_t conn;
+	uint8_t nrtx;
+};
+
+/*
+ * Runs in the tcpip thread, which owns the pcb and may free it on a reset.
+ * lwIP has no other way from a socket to its netconn than the debug lookup.
+ */
+static err_t conn_nrtx_call(struct tcpip_api_call_data *call)
+{
+	struct nrtx_call *c = (struct nrtx_call *)call;
+	struct tcp_pcb *pcb = NULL;
+	struct netconn *nc;
+
+#ifdef CONFIG_BRIDGE_NETCONN
+	nc = c->conn;
+#else
+	struct lwip_sock *sock = lwip_socket_dbg_get_socket(c->conn);
+
+	nc = sock ? sock->conn : NULL;
+#endif
+
+	if (nc)
+		pcb = nc->pcb.tcp;
+	c->nrtx = pcb ? pcb->nrtx : 0;
+
+	return ERR_OK;
+}
+
+/* Retransmissions of the oldest unacknowledged segment, 0 once it's acked */
+static uint8_t conn_nrtx(conn_t conn)
+{
+	struct nrtx_call c = { .conn = conn };
+
+	tcpip_api_call(conn_nrtx_call, &c.call);
+	return c.nrtx;
+}
+
+static void write_uart(const void *data, size_t len)
+{
+	selftest_stamp(SELFTEST_WIFI_RX);
+	capture_record(CAPTURE_DIR_TX, 0, data, len);
+	TRACE(TRACE_UART_WRITE_BEGIN, len);
+	uart_write_bytes(UART_NUM_0, data, len);
+	TRACE(TRACE_UART_WRITE_END, 0);
+	selftest_stamp(SELFTEST_UART_TX);
+	g_stats.bridge.uart_tx += len;
+}
+
+/* g_client.tls doesn't change while the caller holds a reference */
+static ssize_t client_send(conn_t conn, const void *buf, size_t len)
+{
+	return conn_send(conn, g_client.tls, buf, len);
+}
+
+/* Receive from the client into the UART, returns as recv() */
+static ssize_t client_recv(conn_t conn)
+{
+#ifdef CONFIG_BRIDGE_NETCONN
+	/* The pbuf payload goes to the UART driver without a bounce buffer */
+	return nc_recv(conn, write_uart);
+#else
+	ssize_t len;
+
+	len = conn_recv(conn, g_client.tls, rx_buff, sizeof(rx_buff));
+	if (len > 0)
+		write_uart(rx_buff, len);
+
+	return len;
+#endif
+}
+
+bool bridge_client_connected(void)
+{
+	return g_client.conn != CONN_NONE;
+}
+
+static bool client_idle(void)
+{
+	if (!IDLE_TIMEOUT)
+		return false;
+
+	return xTaskGetTickCount() - g_client.active >
+		   IDLE_TIMEOUT * 1000 / portTICK_PERIOD_MS;
+}
 
-static void close_sock(int *sock)
+#ifdef CONFIG_BRIDGE_NETCONN
+static conn_t init_wifi_server(int backlog)
 {
-	shutdown(*sock, SHUT_RDWR);
-	close(*sock);
-	*sock = -1;
+	return nc_listen(SRV_PORT, backlog);
 }
 
-static int init_wifi_server(int backlog)
+static conn_t wait_for_wifi_client(conn_t srv)
+{
+	return nc_accept(srv);
+}
+#else
+static conn_t init_wifi_server(int backlog)
 {
 	struct sockaddr_in srv_addr;
 	int srv_sock;
@@ -72,7 +369,7 @@ static int init_wifi_server(int backlog)
 	return srv_sock;
 }
 
-static int wait_for_wifi_client(int srv_sock)
+static conn_t wait_for_wifi_client(conn_t srv_sock)
 {
 	struct sockaddr_in addr;
 	socklen_t len = sizeof(addr);
@@ -85,32 +382,109 @@ static int wait_for_wifi_client(int srv_sock)
 	// fcntl(sock, F_SETFL, O_NONBLOCK);
 
 	int opt = 1;
-	setsockopt(sock, SOL_SOCKET, TCP_NODELAY, &opt, sizeof(int));
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+
+	/* Find half-open clients in seconds instead of waiting for the
+	 * retransmission timeout of the next send. */
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(int));
+
+	opt = KEEPALIVE_IDLE;
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(int));
+	opt = KEEPALIVE_INTERVAL;
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(int));
+	opt = KEEPALIVE_COUNT;
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(int));
+
+	/* Wake up the receiving task once a second to check for idle timeout */
+	if (IDLE_TIMEOUT) {
+		struct timeval tv = { .tv_sec = 1 };
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
 
 	return sock;
 }
+#endif
+
+#ifdef CONFIG_BRIDGE_TAKEOVER_AUTH
+/* Clients first send the takeover key terminated by a new line */
+static bool client_auth(int sock, struct tls_conn *tls)
+{
+	const char *key = CONFIG_BRIDGE_TAKEOVER_KEY;
+	struct timeval tv = { .tv_sec = AUTH_TIMEOUT_MS / 1000 };
+	struct timeval restore = { .tv_sec = IDLE_TIMEOUT ? 1 : 0 };
+	TickType_t start = xTaskGetTickCount();
+	char buf[64];
+	size_t len = 0;
+	ssize_t ret;
+	bool ok;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (len < sizeof(buf) - 1) {
+		ret = conn_recv(sock, tls, &buf[len], 1);
+
+		/* TLS waits at most a second and also ends on part of a record */
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+			xTaskGetTickCount() - start < AUTH_TIMEOUT_MS / portTICK_PERIOD_MS)
+			continue;
+
+		if (ret != 1)
+			return false;
+
+		if (buf[len] == '\n')
+			break;
+
+		len++;
+	}
+
+	if (len && buf[len - 1] == '\r')
+		len--;
+	buf[len] = '\0';
+
+	ok = strcmp(buf, key) == 0;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &restore, sizeof(restore));
+	return ok;
+}
+#else
+static bool client_auth(conn_t conn, struct tls_conn *tls)
+{
+	return true;
+}
+#endif
 
 static void recv_wifi_write_uart_task(void *arg)
 {
-	int *client = (int *)arg;
 	ssize_t len;
+	conn_t client;
 
-	/* Block for 100ms. */
+	/* Block for 10ms. */
 	const TickType_t xDelay = 10 / portTICK_PERIOD_MS;
 
 	while (true) {
 
-		if (*client < 0) {
+		client = client_get();
+		if (client == CONN_NONE) {
 			vTaskDelay(xDelay);
 			continue;
 		}
 
-		len = recv(*client, rx_buff, sizeof(rx_buff), 0);
-		if (len < 0) {
-			close_sock(client);
-		} else {
-			uart_write_bytes(UART_NUM_0, rx_buff, len);
+		/* A closed connection returns 0, don't spin on it */
+		TRACE(TRACE_RECV_BEGIN, 0);
+		len = client_recv(client);
+		TRACE(TRACE_RECV_END, len);
+		if (len > 0) {
+			g_client.active = xTaskGetTickCount();
+		} else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* Receive timeout, only fail if idle for too long */
+			len = 1;
+			if (client_idle()) {
+				g_stats.bridge.idle_closed++;
+				len = 0;
+			}
 		}
+
+		client_put(len <= 0);
 	}
 
 	vTaskDelete(NULL);
@@ -134,47 +508,165 @@ static void init_uart(void)
 	uart_param_config(UART_NUM_0, &uart_config);
 }
 
-static bool read_uart_send_wifi(int client, size_t length)
+static bool send_wifi(conn_t client, const uint8_t *buf, size_t len)
+{
+	ssize_t offs, sent;
+	uint8_t nrtx;
+	int retry = 0;
+
+	fault_stall();
+
+	for (sent = offs = 0; offs < len; offs += sent) {
+
+		TRACE(TRACE_SEND_BEGIN, len - offs);
+		sent = client_send(client, &buf[offs], len - offs);
+		TRACE(TRACE_SEND_END, sent);
+
+		/* A blocking send hides TCP retransmissions, count them here */
+		nrtx = conn_nrtx(client);
+		if (nrtx > g_client.nrtx)
+			g_stats.bridge.retransmits += nrtx - g_client.nrtx;
+		g_client.nrtx = nrtx;
+
+		if (sent == 0) {
+			retry++;
+			g_stats.bridge.send_retries++;
+		}
+
+		if (sent)
+			retry = 0;
+
+		if (sent < 0 || retry > 5) {
+			g_stats.bridge.dropped_send += len - offs;
+			return false;
+		}
+
+		g_stats.bridge.wifi_tx += sent;
+	}
+
+	g_client.active = xTaskGetTickCount();
+
+	return true;
+}
+
+/* Send what the filter lets through, without a client only run it */
+static bool send_filtered(conn_t client, const uint8_t *buf, size_t len)
 {
-	ssize_t len, offs, sent;
-	int retry;
+	const uint8_t *out;
+	size_t used, out_len;
+
+	while (len) {
+		used = filter_feed(buf, len, &out, &out_len);
+		buf += used;
+		len -= used;
+
+		if (!out_len)
+			continue;
+
+		if (client == CONN_NONE)
+			g_stats.bridge.dropped_no_client += out_len;
+		else if (!send_wifi(client, out, out_len))
+			return false;
+	}
+
+	return true;
+}
+
+/* On a weak link wait a little for more UART data to send fuller segments */
+static ssize_t read_uart_batch(ssize_t len)
+{
+	size_t batch = link_batch_size();
+	TickType_t wait = link_flush_ms() / portTICK_PERIOD_MS;
+	int more;
+
+	if (batch > sizeof(tx_buff))
+		batch = sizeof(tx_buff);
+
+	if (len >= batch || !wait)
+		return len;
+
+	more = uart_read_bytes(UART_NUM_0, &tx_buff[len], batch - len, wait);
+
+	return more > 0 ? len + more : len;
+}
+
+static bool read_uart_send_wifi(conn_t client, size_t length)
+{
+	size_t avail;
+	ssize_t len;
 
 	while (length) {
 
-		len = length < UART_BUF_SIZE ? length : UART_BUF_SIZE;
+		/* A batch may have taken the data of this event already, don't
+		 * wait for it to arrive a second time */
+		avail = 0;
+		uart_get_buffered_data_len(UART_NUM_0, &avail);
+		if (!avail)
+			return true;
+
+		len = length < avail ? length : avail;
+		if (len > UART_BUF_SIZE)
+			len = UART_BUF_SIZE;
+		TRACE(TRACE_UART_READ_BEGIN, 0);
 		len = uart_read_bytes(UART_NUM_0, tx_buff, len, 20 / portTICK_RATE_MS);
-		if (len < 0)
+		if (len > 0)
+			len = read_uart_batch(len);
+		TRACE(TRACE_UART_READ_END, len);
+
+		if (len <= 0)
 			return true;
 
-		length -= len;
+		selftest_stamp(SELFTEST_UART_RX);
+		capture_record(CAPTURE_DIR_RX, 0, tx_buff, len);
+		g_stats.bridge.uart_rx += len;
+		length -= len < length ? len : length;
 
-		retry = 0;
-		for (sent = offs = 0; offs < len; offs += sent) {
+		if (!send_filtered(client, tx_buff, len))
+			return false;
+	}
 
-			sent = send(client, &tx_buff[offs], len - offs, 0);
-			if (sent == 0)
-				retry++;
+	return true;
+}
 
-			if (sent)
-				retry = 0;
+static void flush_uart(uint32_t *counter)
+{
+	size_t len = 0;
 
-   			if (sent < 0 || retry > 5)
-				return false;
-		}
-	}
+	uart_get_buffered_data_len(UART_NUM_0, &len);
+	uart_flush_input(UART_NUM_0);
+	*counter += len;
+}
+
+static bool send_pattern(void)
+{
+	size_t len;
+	conn_t client;
+
+	client = client_get();
+	if (client == CONN_NONE)
+		return false;
 
+	len = fault_pattern(tx_buff, sizeof(tx_buff));
+	client_put(!send_wifi(client, tx_buff, len));
 	return true;
 }
 
 static void read_uart_send_wifi_task(void *arg)
 {
-	int *client = (int *)arg;
 	uart_event_t event;
+	conn_t client;
 
 	for (;;) {
 
+		// Injected test pattern replaces UART data while pending, without
+		// a client wait for UART events as usual instead of spinning
+		if (fault_pattern_pending() && send_pattern())
+			continue;
+
 		// Waiting for UART event.
-		if (xQueueReceive(uart_queue, (void *)&event, portMAX_DELAY)) {
+		if (xQueueReceive(uart_queue, (void *)&event, UART_EVENT_WAIT)) {
+
+			TRACE(TRACE_UART_EVENT, event.type);
 
 			switch (event.type) {
 				// Event of UART receiving data
@@ -182,12 +674,15 @@ static void read_uart_send_wifi_task(void *arg)
 				// data events than other types of events. If we take too much
 				// time on data event, the queue might be full.
 			case UART_DATA:
-				if (*client < 0) {
-					uart_flush_input(UART_NUM_0);
+				client = client_get();
+				if (client != CONN_NONE) {
+					bool ok = read_uart_send_wifi(client, event.size);
+					client_put(!ok);
+				} else if (filter_active()) {
+					/* Triggers also fire without a client */
+					read_uart_send_wifi(CONN_NONE, event.size);
 				} else {
-					bool ok = read_uart_send_wifi(*client, event.size);
-					if (!ok)
-						close_sock(client);
+					flush_uart(&g_stats.bridge.dropped_no_client);
 				}
 				break;
 
@@ -197,7 +692,9 @@ static void read_uart_send_wifi_task(void *arg)
 				// control for your application. The ISR has already reset the
 				// rx FIFO, As an example, we directly flush the rx buffer here
 				// in order to read more data.
-				uart_flush_input(UART_NUM_0);
+				capture_record(CAPTURE_DIR_RX, CAPTURE_FLAG_FIFO_OVF, NULL, 0);
+				g_stats.bridge.fifo_ovf++;
+				flush_uart(&g_stats.bridge.dropped_overflow);
 				xQueueReset(uart_queue);
 				break;
 
@@ -206,15 +703,21 @@ static void read_uart_send_wifi_task(void *arg)
 				// If buffer full happened, you should consider increasing your
 				// buffer size As an example, we directly flush the rx buffer
 				// here in order to read more data.
-				uart_flush_input(UART_NUM_0);
+				capture_record(CAPTURE_DIR_RX, CAPTURE_FLAG_BUFFER_FULL, NULL, 0);
+				g_stats.bridge.buffer_full++;
+				flush_uart(&g_stats.bridge.dropped_overflow);
 				xQueueReset(uart_queue);
 				break;
 
 			case UART_PARITY_ERR:
+				capture_record(CAPTURE_DIR_RX, CAPTURE_FLAG_PARITY_ERR, NULL, 0);
+				g_stats.bridge.parity_err++;
 				break;
 
 				// Event of UART frame error
 			case UART_FRAME_ERR:
+				capture_record(CAPTURE_DIR_RX, CAPTURE_FLAG_FRAME_ERR, NULL, 0);
+				g_stats.bridge.frame_err++;
 				break;
 
 				// Others
@@ -233,8 +736,7 @@ void wifi_start_ap(void);
 
 static void bridge_task(void *pvParameters)
 {
-	int client = -1;
-	int srv_sock;
+	conn_t srv_sock;
 
 	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
 	esp_wifi_init(&cfg);
@@ -246,27 +748,59 @@ static void bridge_task(void *pvParameters)
 		wifi_start_ap();
 
 	srv_sock = init_wifi_server(2); // Initial server configuration.
-	if (srv_sock < 0)
+	if (srv_sock == CONN_NONE)
 		vTaskDelete(NULL);
 
 	init_uart();
+	capture_start();
+	filter_init();
+	link_start();
 
-	xTaskCreate(read_uart_send_wifi_task, "u2w", 1024, &client, 2, NULL);
-	xTaskCreate(recv_wifi_write_uart_task, "w2u", 1024, &client, 2, NULL);
+#ifdef CONFIG_BRIDGE_TLS
+	tls_init();
+#endif
+
+	g_client_lock = mutex_create(g_client_lock);
+
+	task_create(u2w, read_uart_send_wifi_task, "u2w", NULL, 2);
+	task_create(w2u, recv_wifi_write_uart_task, "w2u", NULL, 2);
 
 	for (;;) {
-		int new_client;
+		struct tls_conn *tls = NULL;
+		conn_t new_client;
 
 		new_client = wait_for_wifi_client(srv_sock);
-		if (new_client < 0)
+		if (new_client == CONN_NONE)
 			continue;
 
-		if (client >= 0) {
-			close(new_client);
+#ifdef CONFIG_BRIDGE_TLS
+		tls = tls_accept(new_client);
+		if (!tls) {
+			conn_close(new_client);
+			continue;
+		}
+#endif
+
+		if (!client_auth(new_client, tls)) {
+			tls_free(tls);
+			conn_close(new_client);
+			g_stats.bridge.auth_failed++;
 			continue;
 		}
 
-		client = new_client;
+		if (!client_set(new_client, tls)) {
+			if (!TAKEOVER || !client_takeover(new_client, tls)) {
+				tls_free(tls);
+				conn_close(new_client);
+				g_stats.bridge.rejected++;
+				continue;
+			}
+
+			g_stats.bridge.evicted++;
+		}
+
+		g_stats.bridge.clients++;
+		wifi_bridge_active(true);
 	}
 }
 
@@ -276,6 +810,7 @@ void app_main()
 	esp_netif_init();
 	esp_event_loop_create_default();
 
-	xTaskCreate(bridge_task, "bridge_task", 1024 * 2, NULL, 2, NULL);
+	mem_report();
 
+	task_create(bridge, bridge_task, "bridge_task", NULL, 2);
 }
@@ -0,0 +1,248 @@
+/* UART traffic capture
+
+   Every chunk of data that crosses the UART, together with line events
+   (overflow, parity and frame errors), is stored as a pcap record in a RAM
+   ring. A single TCP client on CONFIG_BRIDGE_CAPTURE_PORT receives the pcap
+   file header followed by the records as they are produced, so the stream
+   can be saved directly to a .pcap file or piped into Wireshark.
+
+   The link type is LINKTYPE_USER0 (147). Each packet starts with a two byte
+   pseudo header:
+   - direction, CAPTURE_DIR_RX (UART -> WiFi) or CAPTURE_DIR_TX (WiFi -> UART)
+   - event flags, CAPTURE_FLAG_*; event records carry no data, and
+     CAPTURE_FLAG_DROPPED marks the first record after a ring overflow
+
+   Records are only built while a capture client is connected, otherwise
+   capture_record() returns after a single flag test.
+*/
+#include <string.h>
+#include <errno.h>
+
+#include <sdkconfig.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include <esp_timer.h>
+
+#include <lwip/sockets.h>
+
+#include "capture.h"
+#include "mem.h"
+
+#define CAPTURE_BUF_SIZE CONFIG_BRIDGE_CAPTURE_BUF_SIZE
+#define CAPTURE_PORT CONFIG_BRIDGE_CAPTURE_PORT
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_SNAPLEN 65535
+#define LINKTYPE_USER0 147
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+	/* LINKTYPE_USER0 pseudo header */
+	uint8_t dir;
+	uint8_t flags;
+} __attribute__((packed));
+
+static uint8_t cap_ring[CAPTURE_BUF_SIZE];
+static size_t cap_head, cap_tail;
+static uint32_t cap_dropped;
+static volatile bool cap_active;
+
+static SemaphoreHandle_t cap_lock;
+static SemaphoreHandle_t cap_ready;
+
+SEMAPHORE_DEFINE(cap_lock);
+SEMAPHORE_DEFINE(cap_ready);
+TASK_DEFINE(capture, BRIDGE_STACK_CAPTURE);
+
+static void ring_put(const void *data, size_t len)
+{
+	size_t offs = cap_head % CAPTURE_BUF_SIZE;
+	size_t part = CAPTURE_BUF_SIZE - offs;
+
+	if (part > len)
+		part = len;
+
+	memcpy(&cap_ring[offs], data, part);
+	memcpy(cap_ring, (const uint8_t *)data + part, len - part);
+	cap_head += len;
+}
+
+static size_t ring_get(void *data, size_t len)
+{
+	size_t offs = cap_tail % CAPTURE_BUF_SIZE;
+	size_t part = CAPTURE_BUF_SIZE - offs;
+
+	if (len > cap_head - cap_tail)
+		len = cap_head - cap_tail;
+	if (part > len)
+		part = len;
+
+	memcpy(data, &cap_ring[offs], part);
+	memcpy((uint8_t *)data + part, cap_ring, len - part);
+	cap_tail += len;
+	return len;
+}
+
+void capture_record(uint8_t dir, uint8_t flags, const void *data, size_t len)
+{
+	struct pcap_rec_hdr hdr;
+	int64_t now;
+
+	if (!cap_active)
+		return;
+
+	now = esp_timer_get_time();
+
+	hdr.ts_sec = now / 1000000;
+	hdr.ts_usec = now % 1000000;
+	hdr.incl_len = len + 2;
+	hdr.orig_len = len + 2;
+	hdr.dir = dir;
+	hdr.flags = flags;
+
+	xSemaphoreTake(cap_lock, portMAX_DELAY);
+
+	if (CAPTURE_BUF_SIZE - (cap_head - cap_tail) < sizeof(hdr) + len) {
+		cap_dropped++;
+	} else {
+		if (cap_dropped)
+			hdr.flags |= CAPTURE_FLAG_DROPPED;
+		cap_dropped = 0;
+
+		ring_put(&hdr, sizeof(hdr));
+		ring_put(data, len);
+	}
+
+	xSemaphoreGive(cap_lock);
+	xSemaphoreGive(cap_ready);
+}
+
+static int init_capture_server(void)
+{
+	struct sockaddr_in srv_addr;
+	int srv_sock;
+
+	srv_addr.sin_family = AF_INET;
+	srv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	srv_addr.sin_port = htons(CAPTURE_PORT);
+
+	srv_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+	if (srv_sock < 0)
+		return -1;
+
+	if (bind(srv_sock, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) != 0 ||
+		listen(srv_sock, 1) != 0) {
+		close(srv_sock);
+		return -1;
+	}
+
+	return srv_sock;
+}
+
+static bool send_all(int sock, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	ssize_t sent;
+
+	while (len) {
+		sent = send(sock, ptr, len, 0);
+		if (sent <= 0)
+			return false;
+
+		ptr += sent;
+		len -= sent;
+	}
+
+	return true;
+}
+
+/* The client never sends, so readable means closed or reset */
+static bool peer_closed(int sock)
+{
+	uint8_t byte;
+	ssize_t ret;
+
+	ret = recv(sock, &byte, sizeof(byte), MSG_DONTWAIT);
+	if (ret < 0)
+		return errno != EAGAIN && errno != EWOULDBLOCK;
+
+	return ret == 0;
+}
+
+static void capture_task(void *arg)
+{
+	static uint8_t chunk[512];
+	const struct pcap_file_hdr file_hdr = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = PCAP_SNAPLEN,
+		.network = LINKTYPE_USER0
+	};
+	int srv_sock, sock;
+	size_t len;
+
+	srv_sock = init_capture_server();
+	if (srv_sock < 0)
+		vTaskDelete(NULL);
+
+	for (;;) {
+
+		sock = accept(srv_sock, NULL, NULL);
+		if (sock < 0)
+			continue;
+
+		xSemaphoreTake(cap_lock, portMAX_DELAY);
+		cap_tail = cap_head;
+		cap_dropped = 0;
+		cap_active = true;
+		xSemaphoreGive(cap_lock);
+
+		bool ok = send_all(sock, &file_hdr, sizeof(file_hdr));
+
+		while (ok) {
+
+			/* Without data send_all() can't see the client leave */
+			if (!xSemaphoreTake(cap_ready, 100 / portTICK_PERIOD_MS) &&
+			    peer_closed(sock))
+				break;
+
+			do {
+				xSemaphoreTake(cap_lock, portMAX_DELAY);
+				len = ring_get(chunk, sizeof(chunk));
+				xSemaphoreGive(cap_lock);
+
+				if (len)
+					ok = send_all(sock, chunk, len);
+			} while (ok && len);
+		}
+
+		cap_active = false;
+		shutdown(sock, SHUT_RDWR);
+		close(sock);
+	}
+}
+
+void capture_start(void)
+{
+	cap_lock = mutex_create(cap_lock);
+	cap_ready = binary_create(cap_ready);
+
+	task_create(capture, capture_task, "capture", NULL, 1);
+}
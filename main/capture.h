@@ -0,0 +1,29 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Direction of a captured chunk, as seen from the UART. */
+#define CAPTURE_DIR_RX 0
+#define CAPTURE_DIR_TX 1
+
+/* Line events, reported as flags of a zero length record. */
+#define CAPTURE_FLAG_FIFO_OVF    0x01
+#define CAPTURE_FLAG_BUFFER_FULL 0x02
+#define CAPTURE_FLAG_PARITY_ERR  0x04
+#define CAPTURE_FLAG_FRAME_ERR   0x08
+
+/* Set on the first record stored after capture records were lost. */
+#define CAPTURE_FLAG_DROPPED     0x80
+
+#ifdef CONFIG_BRIDGE_CAPTURE
+void capture_start(void);
+void capture_record(uint8_t dir, uint8_t flags, const void *data, size_t len);
+#else
+static inline void capture_start(void) { }
+static inline void capture_record(uint8_t dir, uint8_t flags, const void *data,
+								  size_t len) { }
+#endif
+
+#endif /* __CAPTURE_H__ */
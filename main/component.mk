@@ -6,3 +6,43 @@
 # in the build directory. This behaviour is entirely configurable,
 # please read the ESP-IDF documents if you need to do this.
 #
+
+ifndef CONFIG_BRIDGE_CAPTURE
+COMPONENT_OBJEXCLUDE += capture.o
+endif
+
+ifndef CONFIG_BRIDGE_FAULT_INJECT
+COMPONENT_OBJEXCLUDE += fault.o
+endif
+
+ifndef CONFIG_BRIDGE_TRACE
+COMPONENT_OBJEXCLUDE += trace.o
+endif
+
+ifndef CONFIG_BRIDGE_TLS
+COMPONENT_OBJEXCLUDE += tls.o
+endif
+
+ifndef CONFIG_BRIDGE_FILTER
+COMPONENT_OBJEXCLUDE += filter.o
+endif
+
+ifndef CONFIG_BRIDGE_SELFTEST
+COMPONENT_OBJEXCLUDE += selftest.o
+endif
+
+ifndef CONFIG_BRIDGE_LINK_ADAPT
+COMPONENT_OBJEXCLUDE += link.o
+endif
+
+ifndef CONFIG_BRIDGE_ROAM
+COMPONENT_OBJEXCLUDE += roam.o
+endif
+
+ifndef CONFIG_BRIDGE_NETCONN
+COMPONENT_OBJEXCLUDE += nc.o
+endif
+
+ifdef CONFIG_BRIDGE_HTTPS
+COMPONENT_EMBED_TXTFILES := certs/cacert.pem certs/prvtkey.pem
+endif
@@ -0,0 +1,152 @@
+/* Fault injection for the bridge data path
+
+   POST /fault accepts one command per request:
+   - "rst"          reset the bridge client connection with a TCP RST
+   - "stall=<ms>"   delay every send to the bridge client by <ms>,
+                    0 turns it off; lets the UART ring buffer overflow
+   - "pattern=<n>"  send <n> test pattern frames instead of UART data
+   - "storm=<ms>"   reset the bridge client every <ms>, 0 turns it off;
+                    with a client that reconnects right away this is a
+                    reconnect storm through the client handoff
+   - "off"          cancel everything above
+
+   A pattern frame is FAULT_FRAME_SIZE bytes, four little endian words:
+   seq, seq ^ 0x5a5a5a5a, seq * 2654435761 and the sum of the first three.
+   Sequence numbers restart at 0 with every pattern command, so a receiver
+   can tell lost, duplicated and corrupted frames apart and check them
+   against the drop counters in GET /stats. stress.py in the top directory
+   does that from a Linux host.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "fault.h"
+
+static volatile bool g_fault_rst;
+static volatile uint32_t g_fault_stall_ms;
+static volatile uint32_t g_fault_storm_ms;
+static TickType_t g_fault_storm_last;
+/* Updated by both the httpd and the bridge task, see fault_pattern() */
+static uint32_t g_fault_frames;
+static uint32_t g_fault_seq;
+
+bool fault_take_rst(void)
+{
+	uint32_t ms = g_fault_storm_ms;
+	TickType_t now;
+
+	if (ms) {
+		now = xTaskGetTickCount();
+		/* Both bridge tasks may get here, a second reset does no harm */
+		if (now - g_fault_storm_last >= ms / portTICK_PERIOD_MS) {
+			g_fault_storm_last = now;
+			return true;
+		}
+	}
+
+	if (!g_fault_rst)
+		return false;
+
+	g_fault_rst = false;
+	return true;
+}
+
+void fault_stall(void)
+{
+	uint32_t ms = g_fault_stall_ms;
+
+	if (ms)
+		vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+bool fault_pattern_pending(void)
+{
+	return g_fault_frames != 0;
+}
+
+static void put_le32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val;
+	buf[1] = val >> 8;
+	buf[2] = val >> 16;
+	buf[3] = val >> 24;
+}
+
+size_t fault_pattern(uint8_t *buf, size_t len)
+{
+	uint32_t frames, first, seq, w1, w2;
+
+	/* Claim the frames, "off" or a new pattern may come in any time */
+	portENTER_CRITICAL();
+	frames = MIN(g_fault_frames, len / FAULT_FRAME_SIZE);
+	g_fault_frames -= frames;
+	first = g_fault_seq;
+	g_fault_seq += frames;
+	portEXIT_CRITICAL();
+
+	for (uint32_t i = 0; i < frames; i++, buf += FAULT_FRAME_SIZE) {
+		seq = first + i;
+		w1 = seq ^ 0x5a5a5a5a;
+		w2 = seq * 2654435761u;
+
+		put_le32(&buf[0], seq);
+		put_le32(&buf[4], w1);
+		put_le32(&buf[8], w2);
+		put_le32(&buf[12], seq + w1 + w2);
+	}
+
+	return frames * FAULT_FRAME_SIZE;
+}
+
+esp_err_t fault_endpoint(httpd_req_t *req)
+{
+	int ret, len = req->content_len;
+	const char *str = "OK\n";
+	uint32_t frames;
+	char buf[32];
+
+	ret = httpd_req_recv(req, buf, MIN(len, sizeof(buf) - 1));
+	if (ret <= 0) {
+		if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+			httpd_resp_send_408(req);
+		return ESP_FAIL;
+	}
+
+	buf[ret] = '\0';
+	buf[strcspn(buf, "\r\n")] = '\0';
+
+	if (strcmp(buf, "rst") == 0) {
+		g_fault_rst = true;
+	} else if (strncmp(buf, "stall=", 6) == 0) {
+		g_fault_stall_ms = strtoul(&buf[6], NULL, 10);
+	} else if (strncmp(buf, "storm=", 6) == 0) {
+		g_fault_storm_last = xTaskGetTickCount();
+		g_fault_storm_ms = strtoul(&buf[6], NULL, 10);
+	} else if (strncmp(buf, "pattern=", 8) == 0) {
+		frames = strtoul(&buf[8], NULL, 10);
+		portENTER_CRITICAL();
+		g_fault_seq = 0;
+		g_fault_frames = frames;
+		portEXIT_CRITICAL();
+	} else if (strcmp(buf, "off") == 0) {
+		g_fault_rst = false;
+		g_fault_stall_ms = 0;
+		g_fault_storm_ms = 0;
+		portENTER_CRITICAL();
+		g_fault_seq = 0;
+		g_fault_frames = 0;
+		portEXIT_CRITICAL();
+	} else {
+		str = "Unknown fault, use rst, stall=<ms>, pattern=<frames>, "
+			  "storm=<ms> or off\n";
+	}
+
+	httpd_resp_send(req, str, strlen(str));
+	return ESP_OK;
+}
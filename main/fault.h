@@ -0,0 +1,26 @@
+#ifndef __FAULT_H__
+#define __FAULT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <esp_http_server.h>
+
+/* Size of one test pattern frame, see fault.c */
+#define FAULT_FRAME_SIZE 16
+
+#ifdef CONFIG_BRIDGE_FAULT_INJECT
+bool fault_take_rst(void);
+void fault_stall(void);
+bool fault_pattern_pending(void);
+size_t fault_pattern(uint8_t *buf, size_t len);
+esp_err_t fault_endpoint(httpd_req_t *req);
+#else
+static inline bool fault_take_rst(void) { return false; }
+static inline void fault_stall(void) { }
+static inline bool fault_pattern_pending(void) { return false; }
+static inline size_t fault_pattern(uint8_t *buf, size_t len) { return 0; }
+#endif
+
+#endif /* __FAULT_H__ */
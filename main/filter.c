@@ -0,0 +1,450 @@
+/* UART line filter and trigger notifications
+
+   The filter configuration has one directive per line:
+   - "match=<text>"         forward only lines containing <text>
+   - "trigger=<text>"       send lines containing <text> to the notify address
+   - "context=<n>"          also forward <n> lines after every matching line
+   - "notify=<ip>:<port>"   UDP destination of trigger notifications
+
+   Without any match pattern all data is forwarded unchanged and only the
+   triggers are evaluated. Every notification is one UDP datagram holding
+   the line that fired it.
+
+   All patterns are compiled into one Aho-Corasick automaton, stored as a
+   complete transition table over the bytes that occur in the patterns, so
+   matching costs two table lookups per byte no matter how many patterns
+   are configured. Patterns can't span lines, a new line resets the
+   automaton. Lines longer than FILTER_LINE_MAX are split.
+
+   GET /filter returns the configuration, POST /filter replaces it and
+   stores it in NVM. An empty configuration turns the filter off.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <lwip/sockets.h>
+
+#include "filter.h"
+#include "mem.h"
+#include "nvm.h"
+#include "stats.h"
+
+/* States are uint8_t, which bounds the total pattern length */
+#define FILTER_STATES_MAX 255
+
+#define FILTER_MATCH 0x01
+#define FILTER_TRIGGER 0x02
+
+struct filter_table {
+	uint8_t cls[256];		/* Byte to column in delta, 0 for all others */
+	uint8_t ncls;
+	uint8_t *delta;			/* state * ncls + class to next state */
+	uint8_t *out;			/* FILTER_* flags of every state */
+	bool match;				/* Forward matching lines only */
+	uint32_t context;
+	struct sockaddr_in notify;
+};
+
+static struct {
+	struct filter_table *table;
+	uint8_t state;
+	uint8_t hits;			/* FILTER_* flags seen in the current line */
+	uint32_t context;		/* Lines left to forward after a match */
+	size_t line_len;
+	uint8_t line[FILTER_LINE_MAX];
+	int udp;
+} g_filter = { .udp = -1 };
+
+static char g_filter_conf[FILTER_CONF_MAX];
+
+static SemaphoreHandle_t g_filter_lock;
+SEMAPHORE_DEFINE(g_filter_lock);
+
+static void filter_free(struct filter_table *t)
+{
+	if (!t)
+		return;
+
+	free(t->delta);
+	free(t);
+}
+
+/* Calls fn for every "<key>=<value>" line of conf, stops on false */
+static bool filter_parse(const char *conf, void *arg,
+						 bool (*fn)(void *arg, const char *key,
+									const char *val, size_t len))
+{
+	const char *line, *eq;
+	size_t len;
+
+	for (line = conf; *line; line += len + (line[len] != '\0')) {
+		len = strcspn(line, "\n");
+		if (!len || (len == 1 && line[0] == '\r'))
+			continue;
+
+		eq = memchr(line, '=', len);
+		if (!eq)
+			return false;
+
+		size_t vlen = len - (eq + 1 - line);
+		if (vlen && eq[vlen] == '\r')
+			vlen--;
+
+		char key[16];
+		size_t klen = MIN(eq - line, sizeof(key) - 1);
+		memcpy(key, line, klen);
+		key[klen] = '\0';
+
+		if (!fn(arg, key, eq + 1, vlen))
+			return false;
+	}
+
+	return true;
+}
+
+struct filter_build {
+	struct filter_table *t;
+	uint8_t nstates;
+	size_t bytes;			/* Total pattern length */
+};
+
+static bool is_pattern(const char *key)
+{
+	return strcmp(key, "match") == 0 || strcmp(key, "trigger") == 0;
+}
+
+/* First pass: options, byte classes and the size of the trie */
+static bool filter_scan(void *arg, const char *key, const char *val,
+						size_t len)
+{
+	struct filter_build *b = arg;
+	struct filter_table *t = b->t;
+	char buf[24];
+
+	if (is_pattern(key)) {
+		if (!len || b->bytes + len >= FILTER_STATES_MAX)
+			return false;
+
+		for (size_t i = 0; i < len; i++) {
+			uint8_t c = val[i];
+			if (!t->cls[c])
+				t->cls[c] = t->ncls++;
+		}
+
+		b->bytes += len;
+		if (strcmp(key, "match") == 0)
+			t->match = true;
+	} else if (strcmp(key, "context") == 0) {
+		t->context = strtoul(val, NULL, 10);
+	} else if (strcmp(key, "notify") == 0) {
+		char *port;
+
+		if (len >= sizeof(buf))
+			return false;
+
+		memcpy(buf, val, len);
+		buf[len] = '\0';
+
+		port = strchr(buf, ':');
+		if (!port)
+			return false;
+
+		*port++ = '\0';
+		t->notify.sin_family = AF_INET;
+		t->notify.sin_port = htons(strtoul(port, NULL, 10));
+		if (!inet_aton(buf, &t->notify.sin_addr))
+			return false;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+/* Second pass: insert the patterns into the trie */
+static bool filter_insert(void *arg, const char *key, const char *val,
+						  size_t len)
+{
+	struct filter_build *b = arg;
+	struct filter_table *t = b->t;
+	uint8_t s = 0;
+
+	if (!is_pattern(key))
+		return true;
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t *next = &t->delta[s * t->ncls + t->cls[(uint8_t)val[i]]];
+
+		/* The root is never a child, so 0 means no edge yet */
+		if (!*next)
+			*next = b->nstates++;
+		s = *next;
+	}
+
+	t->out[s] |= strcmp(key, "match") == 0 ? FILTER_MATCH : FILTER_TRIGGER;
+	return true;
+}
+
+/* Turn the trie into a complete automaton, breadth first */
+static bool filter_link(struct filter_table *t, uint8_t nstates)
+{
+	uint8_t *fail, *queue;
+	size_t head = 0, tail = 0;
+
+	fail = calloc(2, nstates);
+	if (!fail)
+		return false;
+	queue = &fail[nstates];
+
+	for (uint8_t c = 0; c < t->ncls; c++) {
+		uint8_t s = t->delta[c];
+		if (s)
+			queue[tail++] = s;
+	}
+
+	while (head < tail) {
+		uint8_t r = queue[head++];
+		uint8_t *row = &t->delta[r * t->ncls];
+		uint8_t *frow = &t->delta[fail[r] * t->ncls];
+
+		t->out[r] |= t->out[fail[r]];
+
+		for (uint8_t c = 0; c < t->ncls; c++) {
+			if (row[c]) {
+				fail[row[c]] = frow[c];
+				queue[tail++] = row[c];
+			} else {
+				row[c] = frow[c];
+			}
+		}
+	}
+
+	free(fail);
+	return true;
+}
+
+static struct filter_table *filter_compile(const char *conf)
+{
+	struct filter_build b = { .nstates = 1 };
+	struct filter_table *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	/* Class 0 stands for every byte that is in no pattern */
+	t->ncls = 1;
+	b.t = t;
+
+	if (!filter_parse(conf, &b, filter_scan))
+		goto fail;
+
+	/* The same byte ends every line, patterns can't contain it */
+	if (t->cls['\n'])
+		goto fail;
+
+	t->delta = calloc(b.bytes + 1, t->ncls + 1);
+	if (!t->delta)
+		goto fail;
+	t->out = &t->delta[(b.bytes + 1) * t->ncls];
+
+	filter_parse(conf, &b, filter_insert);
+
+	if (!filter_link(t, b.nstates))
+		goto fail;
+
+	return t;
+
+fail:
+	filter_free(t);
+	return NULL;
+}
+
+static bool filter_apply(const char *conf)
+{
+	struct filter_table *t = NULL, *old;
+
+	if (*conf) {
+		t = filter_compile(conf);
+		if (!t)
+			return false;
+	}
+
+	xSemaphoreTake(g_filter_lock, portMAX_DELAY);
+	old = g_filter.table;
+	g_filter.table = t;
+	g_filter.state = 0;
+	g_filter.hits = 0;
+	g_filter.context = 0;
+	g_filter.line_len = 0;
+	xSemaphoreGive(g_filter_lock);
+
+	filter_free(old);
+	return true;
+}
+
+void filter_init(void)
+{
+	size_t len = sizeof(g_filter_conf) - 1;
+
+	g_filter_lock = mutex_create(g_filter_lock);
+	g_filter.udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (nvm_read_key("filter", (uint8_t *)g_filter_conf, &len) &&
+		!filter_apply(g_filter_conf))
+		g_filter_conf[0] = '\0';
+}
+
+bool filter_active(void)
+{
+	return g_filter.table != NULL;
+}
+
+static void filter_notify(const struct filter_table *t)
+{
+	ssize_t ret;
+
+	g_stats.filter.triggers++;
+
+	if (!t->notify.sin_port || g_filter.udp < 0)
+		return;
+
+	ret = sendto(g_filter.udp, g_filter.line, g_filter.line_len, MSG_DONTWAIT,
+				 (const struct sockaddr *)&t->notify, sizeof(t->notify));
+	if (ret < 0)
+		g_stats.filter.notify_failed++;
+}
+
+/* Returns whether the line just completed is forwarded */
+static bool filter_line_end(const struct filter_table *t)
+{
+	bool forward = true;
+
+	g_stats.filter.lines++;
+
+	if (g_filter.hits & FILTER_TRIGGER)
+		filter_notify(t);
+
+	if (t->match) {
+		if (g_filter.hits & FILTER_MATCH) {
+			g_filter.context = t->context;
+		} else if (g_filter.context) {
+			g_filter.context--;
+		} else {
+			forward = false;
+			g_stats.filter.dropped += g_filter.line_len;
+		}
+	}
+
+	g_filter.state = 0;
+	g_filter.hits = 0;
+
+	return forward;
+}
+
+/*
+ * Runs UART data through the filter. Returns the number of bytes consumed
+ * and sets out/out_len to the data to forward, if any. Matching lines are
+ * only forwarded once complete, so the caller passes the rest of its
+ * buffer again until all of it is consumed.
+ */
+size_t filter_feed(const uint8_t *data, size_t len, const uint8_t **out,
+				   size_t *out_len)
+{
+	const struct filter_table *t;
+	size_t i;
+
+	xSemaphoreTake(g_filter_lock, portMAX_DELAY);
+
+	t = g_filter.table;
+	if (!t) {
+		xSemaphoreGive(g_filter_lock);
+		*out = data;
+		*out_len = len;
+		return len;
+	}
+
+	/* Without match patterns everything is forwarded as it comes */
+	*out = t->match ? NULL : data;
+	*out_len = 0;
+
+	for (i = 0; i < len; i++) {
+		uint8_t c = data[i];
+		uint8_t s;
+
+		s = t->delta[g_filter.state * t->ncls + t->cls[c]];
+		g_filter.state = s;
+		g_filter.hits |= t->out[s];
+		g_filter.line[g_filter.line_len++] = c;
+
+		if (c != '\n' && g_filter.line_len < FILTER_LINE_MAX)
+			continue;
+
+		bool forward = filter_line_end(t);
+
+		if (t->match) {
+			/* The line buffer is only written again by the next call */
+			if (forward) {
+				*out = g_filter.line;
+				*out_len = g_filter.line_len;
+			}
+			g_filter.line_len = 0;
+			i++;
+			break;
+		}
+
+		g_filter.line_len = 0;
+	}
+
+	if (!t->match)
+		*out_len = i;
+
+	xSemaphoreGive(g_filter_lock);
+
+	return i;
+}
+
+esp_err_t filter_get_endpoint(httpd_req_t *req)
+{
+	httpd_resp_send(req, g_filter_conf, strlen(g_filter_conf));
+	return ESP_OK;
+}
+
+esp_err_t filter_set_endpoint(httpd_req_t *req)
+{
+	static char buf[FILTER_CONF_MAX];
+	int ret, len = req->content_len;
+	const char *str = "OK\n";
+
+	if (len >= sizeof(buf)) {
+		httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too long");
+		return ESP_FAIL;
+	}
+
+	for (ret = 0; ret < len;) {
+		int n = httpd_req_recv(req, &buf[ret], len - ret);
+		if (n <= 0) {
+			if (n == HTTPD_SOCK_ERR_TIMEOUT)
+				httpd_resp_send_408(req);
+			return ESP_FAIL;
+		}
+		ret += n;
+	}
+	buf[len] = '\0';
+
+	if (filter_apply(buf)) {
+		memcpy(g_filter_conf, buf, len + 1);
+		nvm_write_key("filter", (uint8_t *)g_filter_conf, len);
+	} else {
+		str = "Invalid filter\n";
+	}
+
+	httpd_resp_send(req, str, strlen(str));
+	return ESP_OK;
+}
@@ -0,0 +1,33 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <esp_http_server.h>
+
+#ifdef CONFIG_BRIDGE_FILTER
+
+#define FILTER_LINE_MAX CONFIG_BRIDGE_FILTER_LINE_MAX
+#define FILTER_CONF_MAX 512
+
+void filter_init(void);
+bool filter_active(void);
+size_t filter_feed(const uint8_t *data, size_t len, const uint8_t **out,
+				   size_t *out_len);
+esp_err_t filter_get_endpoint(httpd_req_t *req);
+esp_err_t filter_set_endpoint(httpd_req_t *req);
+#else
+static inline void filter_init(void) { }
+static inline bool filter_active(void) { return false; }
+static inline size_t filter_feed(const uint8_t *data, size_t len,
+								 const uint8_t **out, size_t *out_len)
+{
+	*out = data;
+	*out_len = len;
+	return len;
+}
+#endif
+
+#endif /* __FILTER_H__ */
@@ -15,8 +15,18 @@
 
 #include <esp_http_server.h>
 #include <esp_ota_ops.h>
+#ifdef CONFIG_BRIDGE_HTTPS
+#include <esp_https_server.h>
+#endif
 
 #include "nvm.h"
+#include "wifi.h"
+#include "stats.h"
+#include "fault.h"
+#include "filter.h"
+#include "roam.h"
+#include "selftest.h"
+#include "trace.h"
 
 static esp_err_t echo_endpoint(httpd_req_t *req)
 {
@@ -25,8 +35,10 @@ static esp_err_t echo_endpoint(httpd_req_t *req)
 
 	while (remaining > 0) {
 		/* Read the data for the request */
-		if ((ret = httpd_req_recv(req, buf, MIN(remaining, sizeof(buf)))) <=
-			0) {
+		TRACE(TRACE_HTTP_RECV_BEGIN, 0);
+		ret = httpd_req_recv(req, buf, MIN(remaining, sizeof(buf)));
+		TRACE(TRACE_HTTP_RECV_END, ret);
+		if (ret <= 0) {
 			if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
 				/* Retry receiving if timeout occurred */
 				continue;
@@ -122,6 +134,93 @@ static httpd_uri_t password = {
 	.user_ctx = NULL
 };
 
+static esp_err_t power_endpoint(httpd_req_t *req)
+{
+	int ret, len = req->content_len;
+	wifi_power_profile_t profile;
+	char buf[16];
+	const char *str;
+
+	/* Read the profile name from the request */
+	ret = httpd_req_recv(req, buf, MIN(len, sizeof(buf) - 1));
+	if (ret <= 0) {
+		if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+			httpd_resp_send_408(req);
+		return ESP_FAIL;
+	}
+
+	buf[ret] = '\0';
+	buf[strcspn(buf, "\r\n")] = '\0';
+
+	if (!wifi_power_profile_parse(buf, &profile))
+		str = "Unknown profile, use none, modem or adaptive\n";
+	else if (!wifi_set_power_profile(profile))
+		str = "Can't save power profile\n";
+	else
+		str = "OK\n";
+
+	httpd_resp_send(req, str, strlen(str));
+	return ESP_OK;
+}
+
+static esp_err_t wifi_endpoint(httpd_req_t *req)
+{
+	int ret, len = req->content_len;
+	char buf[MAX_SSID_LEN + MAX_PASSPHRASE_LEN + 2];
+	char *ssid, *password, *save;
+	const char *str;
+
+	if (req->method == HTTP_GET) {
+		str = wifi_apply_status();
+		httpd_resp_send(req, str, strlen(str));
+		return ESP_OK;
+	}
+
+	/* SSID and password, separated by a new line */
+	ret = httpd_req_recv(req, buf, MIN(len, sizeof(buf) - 1));
+	if (ret <= 0) {
+		if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+			httpd_resp_send_408(req);
+		return ESP_FAIL;
+	}
+
+	buf[ret] = '\0';
+	ssid = strtok_r(buf, "\r\n", &save);
+	password = strtok_r(NULL, "\r\n", &save);
+
+	if (!ssid || strlen(ssid) > MAX_SSID_LEN ||
+		(password && strlen(password) >= MAX_PASSPHRASE_LEN))
+		str = "Expecting SSID and password on separate lines\n";
+	else if (!wifi_apply_sta(ssid, password ? password : ""))
+		str = "Busy applying previous configuration\n";
+	else
+		str = "Applying, GET /wifi for the result\n";
+
+	httpd_resp_send(req, str, strlen(str));
+	return ESP_OK;
+}
+
+static httpd_uri_t wifi_apply = {
+	.uri = "/wifi",
+	.method = HTTP_POST,
+	.handler = wifi_endpoint,
+	.user_ctx = NULL
+};
+
+static httpd_uri_t wifi_status = {
+	.uri = "/wifi",
+	.method = HTTP_GET,
+	.handler = wifi_endpoint,
+	.user_ctx = NULL
+};
+
+static httpd_uri_t power = {
+	.uri = "/power",
+	.method = HTTP_POST,
+	.handler = power_endpoint,
+	.user_ctx = NULL
+};
+
 void star_reset_procedure(void);
 
 static esp_err_t reset_endpoint(httpd_req_t *req)
@@ -217,13 +316,121 @@ static httpd_uri_t info = {
 	.user_ctx = NULL
 };
 
+static httpd_uri_t stats = {
+	.uri = "/stats",
+	.method = HTTP_GET,
+	.handler = stats_endpoint,
+	.user_ctx = NULL
+};
+
+static httpd_uri_t rtt = {
+	.uri = "/rtt",
+	.method = HTTP_GET,
+	.handler = rtt_endpoint,
+	.user_ctx = NULL
+};
+
+#ifdef CONFIG_BRIDGE_FAULT_INJECT
+static httpd_uri_t fault = {
+	.uri = "/fault",
+	.method = HTTP_POST,
+	.handler = fault_endpoint,
+	.user_ctx = NULL
+};
+#endif
+
+#ifdef CONFIG_BRIDGE_FILTER
+static httpd_uri_t filter_get = {
+	.uri = "/filter",
+	.method = HTTP_GET,
+	.handler = filter_get_endpoint,
+	.user_ctx = NULL
+};
+
+static httpd_uri_t filter_set = {
+	.uri = "/filter",
+	.method = HTTP_POST,
+	.handler = filter_set_endpoint,
+	.user_ctx = NULL
+};
+#endif
+
+#ifdef CONFIG_BRIDGE_SELFTEST
+static httpd_uri_t selftest = {
+	.uri = "/selftest",
+	.method = HTTP_GET,
+	.handler = selftest_endpoint,
+	.user_ctx = NULL
+};
+
+static httpd_uri_t selftest_start = {
+	.uri = "/selftest",
+	.method = HTTP_POST,
+	.handler = selftest_start_endpoint,
+	.user_ctx = NULL
+};
+#endif
+
+#ifdef CONFIG_BRIDGE_ROAM
+static httpd_uri_t networks_get = {
+	.uri = "/networks",
+	.method = HTTP_GET,
+	.handler = roam_endpoint,
+	.user_ctx = NULL
+};
+
+static httpd_uri_t networks_set = {
+	.uri = "/networks",
+	.method = HTTP_POST,
+	.handler = roam_endpoint,
+	.user_ctx = NULL
+};
+#endif
+
+#ifdef CONFIG_BRIDGE_TRACE
+static httpd_uri_t trace = {
+	.uri = "/trace",
+	.method = HTTP_GET,
+	.handler = trace_endpoint,
+	.user_ctx = NULL
+};
+#endif
+
+#ifdef CONFIG_BRIDGE_HTTPS
+extern const uint8_t cacert_pem_start[] asm("_binary_cacert_pem_start");
+extern const uint8_t cacert_pem_end[] asm("_binary_cacert_pem_end");
+extern const uint8_t prvtkey_pem_start[] asm("_binary_prvtkey_pem_start");
+extern const uint8_t prvtkey_pem_end[] asm("_binary_prvtkey_pem_end");
+
+static esp_err_t server_start(httpd_handle_t *server)
+{
+	httpd_ssl_config_t config = HTTPD_SSL_CONFIG_DEFAULT();
+
+	config.httpd.max_uri_handlers = 20;
+	config.cacert_pem = cacert_pem_start;
+	config.cacert_len = cacert_pem_end - cacert_pem_start;
+	config.prvtkey_pem = prvtkey_pem_start;
+	config.prvtkey_len = prvtkey_pem_end - prvtkey_pem_start;
+
+	return httpd_ssl_start(server, &config);
+}
+#else
+static esp_err_t server_start(httpd_handle_t *server)
+{
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+
+	config.max_uri_handlers = 20;
+
+	return httpd_start(server, &config);
+}
+#endif
+
 static httpd_handle_t start_webserver(void)
 {
 	httpd_handle_t server = NULL;
-	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
 	// Start the httpd server
-	if (httpd_start(&server, &config) == ESP_OK) {
+	if (server_start(&server) == ESP_OK) {
 		// Set URI handlers
 		httpd_register_uri_handler(server, &echo);
 		httpd_register_uri_handler(server, &upgrade);
@@ -231,18 +438,35 @@ static httpd_handle_t start_webserver(void)
 		httpd_register_uri_handler(server, &info);
 		httpd_register_uri_handler(server, &ssid);
 		httpd_register_uri_handler(server, &password);
+		httpd_register_uri_handler(server, &power);
+		httpd_register_uri_handler(server, &wifi_apply);
+		httpd_register_uri_handler(server, &wifi_status);
+		httpd_register_uri_handler(server, &stats);
+		httpd_register_uri_handler(server, &rtt);
+#ifdef CONFIG_BRIDGE_FAULT_INJECT
+		httpd_register_uri_handler(server, &fault);
+#endif
+#ifdef CONFIG_BRIDGE_TRACE
+		httpd_register_uri_handler(server, &trace);
+#endif
+#ifdef CONFIG_BRIDGE_FILTER
+		httpd_register_uri_handler(server, &filter_get);
+		httpd_register_uri_handler(server, &filter_set);
+#endif
+#ifdef CONFIG_BRIDGE_SELFTEST
+		httpd_register_uri_handler(server, &selftest);
+		httpd_register_uri_handler(server, &selftest_start);
+#endif
+#ifdef CONFIG_BRIDGE_ROAM
+		httpd_register_uri_handler(server, &networks_get);
+		httpd_register_uri_handler(server, &networks_set);
+#endif
 		return server;
 	}
 
 	return NULL;
 }
 
-static void stop_webserver(httpd_handle_t server)
-{
-	// Stop the httpd server
-	httpd_stop(server);
-}
-
 static httpd_handle_t g_server = NULL;
 
 static void disconnect_handler(void *arg, esp_event_base_t event_base,
@@ -250,14 +474,12 @@ static void disconnect_handler(void *arg, esp_event_base_t event_base,
 {
 	httpd_handle_t *server = (httpd_handle_t *)arg;
 
+	TRACE(TRACE_WIFI_EVENT, event_id);
+
+	/* The server listens on any address, so once started it is kept running
+	 * while the station reconnects or switches between AP and STA mode,
+	 * instead of being torn down and reallocated. */
 	switch (event_id) {
-	case WIFI_EVENT_AP_STOP:
-	case WIFI_EVENT_STA_DISCONNECTED:
-		if (*server) {
-			stop_webserver(*server);
-			*server = NULL;
-		}
-		break;
 	case WIFI_EVENT_AP_START:
 		if (*server == NULL)
 			*server = start_webserver();
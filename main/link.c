@@ -0,0 +1,154 @@
+/* Link quality monitor
+
+   Samples the station RSSI and the TCP retransmissions and send failures
+   of the bridge every CONFIG_BRIDGE_LINK_PERIOD seconds and rates the link
+   good, fair or poor. The rating selects how the bridge sends:
+   - on a good link UART data is sent as soon as it is read
+   - on worse links UART data is collected into larger batches, up to a
+     flush deadline, so fewer and fuller segments go over the air and
+     fewer of them need retransmission
+   - below a good link the TX power is raised to the maximum
+
+   Moving to a better level needs LINK_HYSTERESIS_DB more signal than the
+   threshold, so the rating doesn't flap around it. Every change of level
+   is logged in GET /stats.
+*/
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_wifi.h>
+#include <esp_timer.h>
+
+#include "link.h"
+#include "mem.h"
+#include "stats.h"
+
+#define LINK_PERIOD_MS (CONFIG_BRIDGE_LINK_PERIOD * 1000)
+#define LINK_RSSI_GOOD CONFIG_BRIDGE_LINK_RSSI_GOOD
+#define LINK_RSSI_POOR CONFIG_BRIDGE_LINK_RSSI_POOR
+#define LINK_HYSTERESIS_DB 3
+
+/* Retransmissions per period that make a link poor regardless of RSSI */
+#define LINK_POOR_FAILURES 5
+
+/* TX power in 0.25 dBm steps, 82 is 20.5 dBm, the maximum */
+#define LINK_TX_POWER_MAX 82
+
+struct link_policy {
+	uint16_t batch;			/* UART bytes collected per send, 0 for none */
+	uint16_t flush_ms;		/* Longest wait for a batch to fill up */
+	int8_t tx_power;
+};
+
+static const struct link_policy link_policies[LINK_LEVELS] = {
+	[LINK_GOOD] = { 0, 0, CONFIG_BRIDGE_LINK_TX_POWER_GOOD },
+	[LINK_FAIR] = { 256, 20, LINK_TX_POWER_MAX },
+	[LINK_POOR] = { 1024, 50, LINK_TX_POWER_MAX },
+};
+
+static const char *link_level_names[LINK_LEVELS] = {
+	"good", "fair", "poor"
+};
+
+static volatile link_level_t g_link_level = LINK_GOOD;
+
+TASK_DEFINE(link, BRIDGE_STACK_LINK);
+
+const char *link_level_name(link_level_t level)
+{
+	if (level >= LINK_LEVELS)
+		return "unknown";
+
+	return link_level_names[level];
+}
+
+size_t link_batch_size(void)
+{
+	return link_policies[g_link_level].batch;
+}
+
+uint32_t link_flush_ms(void)
+{
+	return link_policies[g_link_level].flush_ms;
+}
+
+static link_level_t link_rate(int rssi, uint32_t failures, link_level_t cur)
+{
+	if (failures >= LINK_POOR_FAILURES || rssi < LINK_RSSI_POOR)
+		return LINK_POOR;
+
+	if (cur == LINK_POOR && rssi < LINK_RSSI_POOR + LINK_HYSTERESIS_DB)
+		return LINK_POOR;
+
+	if (failures || rssi < LINK_RSSI_GOOD)
+		return LINK_FAIR;
+
+	if (cur != LINK_GOOD && rssi < LINK_RSSI_GOOD + LINK_HYSTERESIS_DB)
+		return LINK_FAIR;
+
+	return LINK_GOOD;
+}
+
+static void link_set(link_level_t level, int rssi, uint32_t failures)
+{
+	struct link_stats *s = &g_stats.link;
+	struct link_decision *d = &s->log[s->changes % LINK_DECISIONS];
+
+	d->time = esp_timer_get_time() / 1000000;
+	d->rssi = rssi;
+	d->from = g_link_level;
+	d->to = level;
+	d->failures = failures;
+	s->changes++;
+	s->level = level;
+
+	esp_wifi_set_max_tx_power(link_policies[level].tx_power);
+	g_link_level = level;
+}
+
+static void link_task(void *arg)
+{
+	const struct data_stats *b = &g_stats.bridge;
+	uint32_t retries = b->send_retries, dropped = b->dropped_send;
+	uint32_t rexmits = b->retransmits;
+	uint32_t failures;
+	wifi_ap_record_t ap;
+	link_level_t level;
+	int rssi = 0;
+
+	for (;;) {
+		vTaskDelay(LINK_PERIOD_MS / portTICK_PERIOD_MS);
+
+		failures = b->send_retries - retries + b->retransmits - rexmits;
+		if (b->dropped_send != dropped)
+			failures += LINK_POOR_FAILURES;
+
+		retries = b->send_retries;
+		rexmits = b->retransmits;
+		dropped = b->dropped_send;
+
+		/* Not connected as station, nothing to adapt to */
+		if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+			rssi = 0;
+			continue;
+		}
+
+		/* Smooth out single samples, start from the first one */
+		rssi = rssi ? (3 * rssi + ap.rssi) / 4 : ap.rssi;
+
+		g_stats.link.rssi = rssi;
+		g_stats.link.failures = failures;
+
+		level = link_rate(rssi, failures, g_link_level);
+		if (level != g_link_level)
+			link_set(level, rssi, failures);
+	}
+}
+
+void link_start(void)
+{
+	esp_wifi_set_max_tx_power(link_policies[g_link_level].tx_power);
+	task_create(link, link_task, "link", NULL, 2);
+}
@@ -0,0 +1,26 @@
+#ifndef __LINK_H__
+#define __LINK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Station link quality as judged by the link monitor */
+typedef enum {
+	LINK_GOOD,
+	LINK_FAIR,
+	LINK_POOR,
+	LINK_LEVELS
+} link_level_t;
+
+#ifdef CONFIG_BRIDGE_LINK_ADAPT
+void link_start(void);
+const char *link_level_name(link_level_t level);
+size_t link_batch_size(void);
+uint32_t link_flush_ms(void);
+#else
+static inline void link_start(void) { }
+static inline size_t link_batch_size(void) { return 0; }
+static inline uint32_t link_flush_ms(void) { return 0; }
+#endif
+
+#endif /* __LINK_H__ */
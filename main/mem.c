@@ -0,0 +1,137 @@
+/* Memory budget
+
+   RAM used by the bridge subsystems, computed at build time from the same
+   sizes the subsystems are built with. The total must fit into
+   CONFIG_BRIDGE_MEM_BUDGET or the build fails. The table is logged at boot
+   and reported by GET /stats, together with the free heap sampled after
+   every WiFi (re)connect and OTA upgrade, which must stay flat.
+*/
+#include <sdkconfig.h>
+
+#include <esp_system.h>
+#include <esp_log.h>
+
+#include "filter.h"
+#include "mem.h"
+#include "roam.h"
+#include "selftest.h"
+#include "stats.h"
+
+#define TASK_BYTES(depth) ((depth) * sizeof(StackType_t) + sizeof(StaticTask_t))
+
+#define MEM_TASKS (TASK_BYTES(BRIDGE_STACK_MAIN) + TASK_BYTES(BRIDGE_STACK_U2W) + \
+				   TASK_BYTES(BRIDGE_STACK_W2U) + TASK_BYTES(BRIDGE_STACK_RESET) + \
+				   TASK_BYTES(BRIDGE_STACK_APPLY))
+#ifdef CONFIG_BRIDGE_NETCONN
+#define MEM_BRIDGE BRIDGE_UART_BUF_SIZE	/* No receive buffer */
+#else
+#define MEM_BRIDGE (2 * BRIDGE_UART_BUF_SIZE)
+#endif
+#define MEM_OTA BRIDGE_OTA_BUF_SIZE
+
+#ifdef CONFIG_BRIDGE_CAPTURE
+#define MEM_CAPTURE (TASK_BYTES(BRIDGE_STACK_CAPTURE) + \
+					 CONFIG_BRIDGE_CAPTURE_BUF_SIZE + 512 + \
+					 2 * sizeof(StaticSemaphore_t))
+#else
+#define MEM_CAPTURE 0
+#endif
+
+#ifdef CONFIG_BRIDGE_TRACE
+#define MEM_TRACE (CONFIG_BRIDGE_TRACE_RECORDS * 12)
+#else
+#define MEM_TRACE 0
+#endif
+
+#ifdef CONFIG_BRIDGE_FILTER
+/* Line buffer and two copies of the configuration, the automaton is heap */
+#define MEM_FILTER (FILTER_LINE_MAX + 2 * FILTER_CONF_MAX + \
+					sizeof(StaticSemaphore_t))
+#else
+#define MEM_FILTER 0
+#endif
+
+#ifdef CONFIG_BRIDGE_SELFTEST
+/* Task, two transfer chunks and the result */
+#define MEM_SELFTEST (TASK_BYTES(BRIDGE_STACK_SELFTEST) + 2 * SELFTEST_CHUNK + \
+					  sizeof(struct selftest_result) + \
+					  sizeof(StaticSemaphore_t))
+#else
+#define MEM_SELFTEST 0
+#endif
+
+#ifdef CONFIG_BRIDGE_LINK_ADAPT
+#define MEM_LINK TASK_BYTES(BRIDGE_STACK_LINK)
+#else
+#define MEM_LINK 0
+#endif
+
+#ifdef CONFIG_BRIDGE_ROAM
+/* Task, the stored networks and their ranking, the scan results are heap */
+#define MEM_ROAM (TASK_BYTES(BRIDGE_STACK_ROAM) + \
+				  ROAM_NETWORKS_MAX * (MAX_SSID_LEN + MAX_PASSPHRASE_LEN + 20) + \
+				  sizeof(StaticSemaphore_t))
+#else
+#define MEM_ROAM 0
+#endif
+
+#define MEM_TOTAL (MEM_TASKS + MEM_BRIDGE + MEM_OTA + MEM_CAPTURE + MEM_TRACE + \
+				   MEM_FILTER + MEM_SELFTEST + MEM_LINK + MEM_ROAM)
+
+_Static_assert(MEM_TOTAL <= CONFIG_BRIDGE_MEM_BUDGET,
+			   "bridge RAM usage exceeds CONFIG_BRIDGE_MEM_BUDGET");
+
+static const char *TAG = "mem";
+
+static const struct mem_usage usage[] = {
+	{ "tasks", MEM_TASKS },
+	{ "bridge buffers", MEM_BRIDGE },
+	{ "ota buffer", MEM_OTA },
+#ifdef CONFIG_BRIDGE_CAPTURE
+	{ "capture", MEM_CAPTURE },
+#endif
+#ifdef CONFIG_BRIDGE_TRACE
+	{ "trace", MEM_TRACE },
+#endif
+#ifdef CONFIG_BRIDGE_FILTER
+	{ "filter", MEM_FILTER },
+#endif
+#ifdef CONFIG_BRIDGE_SELFTEST
+	{ "self-test", MEM_SELFTEST },
+#endif
+#ifdef CONFIG_BRIDGE_LINK_ADAPT
+	{ "link monitor", MEM_LINK },
+#endif
+#ifdef CONFIG_BRIDGE_ROAM
+	{ "roaming", MEM_ROAM },
+#endif
+	{ NULL, 0 }
+};
+
+uint32_t mem_budget(const struct mem_usage **table)
+{
+	*table = usage;
+	return MEM_TOTAL;
+}
+
+void mem_report(void)
+{
+	for (const struct mem_usage *u = usage; u->name; u++)
+		ESP_LOGI(TAG, "%-16s %6u bytes", u->name, u->bytes);
+
+	ESP_LOGI(TAG, "%-16s %6u of %u bytes", "total", (uint32_t)MEM_TOTAL,
+			 CONFIG_BRIDGE_MEM_BUDGET);
+}
+
+void mem_sample_heap(void)
+{
+	struct heap_stats *heap = &g_stats.heap;
+	uint32_t free = esp_get_free_heap_size();
+
+	if (!heap->samples)
+		heap->first = free;
+
+	heap->samples++;
+	heap->last = free;
+	heap->lowest = esp_get_minimum_free_heap_size();
+}
@@ -0,0 +1,77 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/event_groups.h>
+
+/* Stack depth of every bridge task, in StackType_t units as for xTaskCreate */
+#define BRIDGE_STACK_MAIN CONFIG_BRIDGE_STACK_MAIN
+#define BRIDGE_STACK_U2W CONFIG_BRIDGE_STACK_U2W
+#define BRIDGE_STACK_W2U CONFIG_BRIDGE_STACK_W2U
+#define BRIDGE_STACK_RESET CONFIG_BRIDGE_STACK_RESET
+#define BRIDGE_STACK_CAPTURE CONFIG_BRIDGE_STACK_CAPTURE
+#define BRIDGE_STACK_APPLY CONFIG_BRIDGE_STACK_APPLY
+#define BRIDGE_STACK_SELFTEST CONFIG_BRIDGE_STACK_SELFTEST
+#define BRIDGE_STACK_LINK CONFIG_BRIDGE_STACK_LINK
+#define BRIDGE_STACK_ROAM CONFIG_BRIDGE_STACK_ROAM
+
+#define BRIDGE_UART_BUF_SIZE 1024
+#define BRIDGE_OTA_BUF_SIZE 512
+
+/*
+ * Tasks, semaphores and event groups are declared with the *_DEFINE macros
+ * and created with the matching *_create macros. With
+ * CONFIG_BRIDGE_STATIC_ALLOC they live in .bss, otherwise they come from the
+ * heap as before. Either way the memory is accounted in mem.c.
+ */
+#ifdef CONFIG_BRIDGE_STATIC_ALLOC
+
+#if !configSUPPORT_STATIC_ALLOCATION
+#error "CONFIG_BRIDGE_STATIC_ALLOC needs FreeRTOS static allocation support"
+#endif
+
+#define TASK_DEFINE(name, depth) \
+	static StackType_t name##_stack[depth]; \
+	static StaticTask_t name##_tcb
+
+#define task_create(name, fn, label, arg, prio) \
+	xTaskCreateStatic(fn, label, sizeof(name##_stack) / sizeof(StackType_t), \
+					  arg, prio, name##_stack, &name##_tcb)
+
+#define SEMAPHORE_DEFINE(name) static StaticSemaphore_t name##_buf
+#define mutex_create(name) xSemaphoreCreateMutexStatic(&name##_buf)
+#define binary_create(name) xSemaphoreCreateBinaryStatic(&name##_buf)
+
+#define EVENT_GROUP_DEFINE(name) static StaticEventGroup_t name##_buf
+#define event_group_create(name) xEventGroupCreateStatic(&name##_buf)
+
+#else
+
+#define TASK_DEFINE(name, depth) enum { name##_depth = depth }
+
+#define task_create(name, fn, label, arg, prio) \
+	xTaskCreate(fn, label, name##_depth, arg, prio, NULL)
+
+#define SEMAPHORE_DEFINE(name) struct name##_unused
+#define mutex_create(name) xSemaphoreCreateMutex()
+#define binary_create(name) xSemaphoreCreateBinary()
+
+#define EVENT_GROUP_DEFINE(name) struct name##_unused
+#define event_group_create(name) xEventGroupCreate()
+
+#endif
+
+struct mem_usage {
+	const char *name;
+	uint32_t bytes;
+};
+
+uint32_t mem_budget(const struct mem_usage **table);
+void mem_report(void);
+void mem_sample_heap(void);
+
+#endif /* __MEM_H__ */
@@ -0,0 +1,148 @@
+/* Bridge transport on the lwIP netconn API
+
+   Same semantics as the socket calls the bridge uses otherwise, without
+   the socket layer. Received pbufs are handed to a sink in place instead
+   of being copied into a receive buffer first. Sent data is still copied
+   once into pbufs, lwIP has to keep it until it is acknowledged.
+*/
+#include <errno.h>
+
+#include <lwip/api.h>
+#include <lwip/tcp.h>
+#include <lwip/tcpip.h>
+
+#include "nc.h"
+
+#define KEEPALIVE_IDLE CONFIG_BRIDGE_KEEPALIVE_IDLE
+#define KEEPALIVE_INTERVAL CONFIG_BRIDGE_KEEPALIVE_INTERVAL
+#define KEEPALIVE_COUNT CONFIG_BRIDGE_KEEPALIVE_COUNT
+
+/*
+ * Blocked calls return every second, as a shutdown from the other task
+ * doesn't wake them up on every lwIP configuration.
+ */
+#define NC_TIMEOUT_MS 1000
+
+struct nc_opts_call {
+	struct tcpip_api_call_data call;
+	struct netconn *conn;
+};
+
+/* Runs in the tcpip thread, which owns the pcb */
+static err_t nc_set_opts(struct tcpip_api_call_data *call)
+{
+	struct tcp_pcb *pcb = ((struct nc_opts_call *)call)->conn->pcb.tcp;
+
+	if (!pcb)
+		return ERR_CLSD;
+
+	tcp_nagle_disable(pcb);
+
+	ip_set_option(pcb, SOF_KEEPALIVE);
+	pcb->keep_idle = KEEPALIVE_IDLE * 1000;
+	pcb->keep_intvl = KEEPALIVE_INTERVAL * 1000;
+	pcb->keep_cnt = KEEPALIVE_COUNT;
+
+	return ERR_OK;
+}
+
+struct netconn *nc_listen(uint16_t port, int backlog)
+{
+	struct netconn *srv;
+
+	srv = netconn_new(NETCONN_TCP);
+	if (!srv)
+		return NULL;
+
+	if (netconn_bind(srv, IP_ADDR_ANY, port) != ERR_OK ||
+		netconn_listen_with_backlog(srv, backlog) != ERR_OK) {
+		netconn_delete(srv);
+		return NULL;
+	}
+
+	return srv;
+}
+
+struct netconn *nc_accept(struct netconn *srv)
+{
+	struct nc_opts_call opts;
+	struct netconn *conn;
+
+	if (netconn_accept(srv, &conn) != ERR_OK)
+		return NULL;
+
+	opts.conn = conn;
+	if (tcpip_api_call(nc_set_opts, &opts.call) != ERR_OK) {
+		netconn_delete(conn);
+		return NULL;
+	}
+
+	netconn_set_recvtimeout(conn, NC_TIMEOUT_MS);
+#if LWIP_SO_SNDTIMEO
+	netconn_set_sendtimeout(conn, NC_TIMEOUT_MS);
+#endif
+
+	return conn;
+}
+
+/* Returns the bytes queued, 0 if the send buffer stayed full */
+ssize_t nc_send(struct netconn *conn, const void *buf, size_t len)
+{
+	size_t written = 0;
+	err_t err;
+
+	err = netconn_write_partly(conn, buf, len, NETCONN_COPY, &written);
+	if (err != ERR_OK && err != ERR_WOULDBLOCK) {
+		errno = EIO;
+		return -1;
+	}
+
+	return written;
+}
+
+/* Returns as recv(), -1 with errno EAGAIN on timeout */
+ssize_t nc_recv(struct netconn *conn, nc_sink_t sink)
+{
+	struct pbuf *p, *q;
+	ssize_t len = 0;
+	err_t err;
+
+	err = netconn_recv_tcp_pbuf(conn, &p);
+	if (err == ERR_TIMEOUT || err == ERR_WOULDBLOCK) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (err == ERR_CLSD)
+		return 0;
+
+	if (err != ERR_OK) {
+		errno = EIO;
+		return -1;
+	}
+
+	for (q = p; q; q = q->next) {
+		sink(q->payload, q->len);
+		len += q->len;
+	}
+
+	pbuf_free(p);
+
+	return len;
+}
+
+void nc_shutdown(struct netconn *conn, bool reset)
+{
+#if LWIP_SO_LINGER
+	/* Abort with RST instead of FIN, like SO_LINGER on a socket */
+	if (reset)
+		conn->linger = 0;
+#endif
+
+	netconn_shutdown(conn, 1, 1);
+}
+
+void nc_close(struct netconn *conn)
+{
+	netconn_delete(conn);
+}
@@ -0,0 +1,21 @@
+#ifndef __NC_H__
+#define __NC_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <lwip/api.h>
+
+/* Receives the payload of every pbuf in place */
+typedef void (*nc_sink_t)(const void *data, size_t len);
+
+struct netconn *nc_listen(uint16_t port, int backlog);
+struct netconn *nc_accept(struct netconn *srv);
+ssize_t nc_send(struct netconn *conn, const void *buf, size_t len);
+ssize_t nc_recv(struct netconn *conn, nc_sink_t sink);
+void nc_shutdown(struct netconn *conn, bool reset);
+void nc_close(struct netconn *conn);
+
+#endif /* __NC_H__ */
@@ -26,8 +26,12 @@
 #include <esp_ota_ops.h>
 #include <esp_http_server.h>
 
+#include "mem.h"
+#include "trace.h"
 
-#define OTA_BUF_SIZE CONFIG_OTA_BUF_SIZE
+#define OTA_BUF_SIZE BRIDGE_OTA_BUF_SIZE
+
+TASK_DEFINE(reset, BRIDGE_STACK_RESET);
 
 static void reset_task(void *pvParameters)
 {
@@ -40,12 +44,19 @@ static void reset_task(void *pvParameters)
 	}
 }
 
+/* Called from httpd only, a second request must not reuse the live task */
 void star_reset_procedure(void)
 {
-	xTaskCreate(reset_task, "reset_task", 512, NULL, 1, NULL);
+	static bool scheduled;
+
+	if (scheduled)
+		return;
+
+	scheduled = true;
+	task_create(reset, reset_task, "reset_task", NULL, 1);
 }
 
-static char up_buf[512];
+static char up_buf[OTA_BUF_SIZE];
 
 /* An HTTP POST handler */
 esp_err_t upgrade_endpoint(httpd_req_t *req)
@@ -76,7 +87,9 @@ esp_err_t upgrade_endpoint(httpd_req_t *req)
 	while (remaining > 0) {
 
 		/* Read the data for the request */
+		TRACE(TRACE_HTTP_RECV_BEGIN, 0);
 		ret = httpd_req_recv(req, up_buf, MIN(remaining, sizeof(up_buf)));
+		TRACE(TRACE_HTTP_RECV_END, ret);
 		if (ret <= 0) {
 			if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
 				/* Retry receiving if timeout occurred */
@@ -84,13 +97,20 @@ esp_err_t upgrade_endpoint(httpd_req_t *req)
 			}
 			resp_str = "Receive error\n";
 			httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+			/* Release the OTA handle, keeps the heap flat across retries */
+			esp_ota_end(ota_handle);
+			mem_sample_heap();
 			return ESP_FAIL;
 		}
 
+		TRACE(TRACE_OTA_WRITE_BEGIN, ret);
 		err = esp_ota_write(ota_handle, (const void *)up_buf, ret);
+		TRACE(TRACE_OTA_WRITE_END, err);
 		if (err != ESP_OK) {
 			resp_str = "Write OTA error\n";
 			httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+			esp_ota_end(ota_handle);
+			mem_sample_heap();
 			return ESP_FAIL;
 		} 
 
@@ -104,6 +124,7 @@ esp_err_t upgrade_endpoint(httpd_req_t *req)
 	}
 
 	err = esp_ota_end(ota_handle);
+	mem_sample_heap();
 	if (err != ESP_OK) {
 		resp_str = "Finish OTA failed\n";
 		httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
@@ -0,0 +1,508 @@
+/* Stored networks and failover
+
+   Up to ROAM_NETWORKS_MAX networks are stored in NVM, each with a
+   priority and the BSSID and channel of the AP it was last connected to.
+   At boot the station first connects directly to the last used AP, which
+   skips the scan. If that fails, one scan ranks the stored networks that
+   are in range by priority and then RSSI, and they are tried in that
+   order.
+
+   In the background the roaming task fails over to the next best network
+   when the station gave up on its AP, or when the RSSI stayed below
+   CONFIG_BRIDGE_ROAM_RSSI for ROAM_WEAK_SAMPLES periods and another
+   stored AP is at least CONFIG_BRIDGE_ROAM_DELTA dB stronger.
+
+   POST /networks adds or updates a network from three lines, priority,
+   SSID and password, or removes it with "remove" and the SSID on two
+   lines. GET /networks lists them. Without stored networks the station
+   uses the single SSID and password as before.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include <esp_wifi.h>
+#include <esp_timer.h>
+
+#include "mem.h"
+#include "nvm.h"
+#include "roam.h"
+#include "stats.h"
+#include "wifi.h"
+
+#define ROAM_PERIOD_MS (CONFIG_BRIDGE_ROAM_PERIOD * 1000)
+#define ROAM_RSSI CONFIG_BRIDGE_ROAM_RSSI
+#define ROAM_DELTA CONFIG_BRIDGE_ROAM_DELTA
+#define ROAM_WEAK_SAMPLES 3
+#define ROAM_SCAN_MAX 16
+
+struct roam_network {
+	char ssid[MAX_SSID_LEN + 1];		/* Empty for an unused slot */
+	char password[MAX_PASSPHRASE_LEN];
+	uint8_t priority;					/* Higher is preferred */
+	uint8_t channel;					/* Of the last AP, 0 if unknown */
+	uint8_t bssid[6];
+};
+
+struct roam_candidate {
+	uint8_t net;
+	bool seen;				/* Found by the last scan */
+	int8_t rssi;
+	uint8_t channel;
+	uint8_t bssid[6];
+};
+
+/* Used by httpd, the WiFi apply and the roaming task, under g_roam_lock */
+static struct roam_network g_networks[ROAM_NETWORKS_MAX];
+static uint8_t g_last = ROAM_NETWORKS_MAX;	/* Network connected last */
+static struct roam_candidate g_candidates[ROAM_NETWORKS_MAX];
+
+static SemaphoreHandle_t g_roam_lock = NULL;
+SEMAPHORE_DEFINE(g_roam_lock);
+
+/* Set from the event loop, the roaming task caches the AP */
+static volatile bool g_roam_connected;
+
+static SemaphoreHandle_t g_roam_wake = NULL;
+SEMAPHORE_DEFINE(g_roam_wake);
+TASK_DEFINE(roam, BRIDGE_STACK_ROAM);
+
+/* Called with g_roam_lock held */
+static void roam_save(void)
+{
+	nvm_write_key("networks", (uint8_t *)g_networks, sizeof(g_networks));
+	nvm_write_key("roam_last", &g_last, sizeof(g_last));
+}
+
+void roam_init(void)
+{
+	size_t len = sizeof(g_networks);
+
+	if (!g_roam_lock)
+		g_roam_lock = mutex_create(g_roam_lock);
+
+	if (!nvm_read_key("networks", (uint8_t *)g_networks, &len) ||
+		len != sizeof(g_networks))
+		memset(g_networks, 0, sizeof(g_networks));
+
+	len = sizeof(g_last);
+	if (!nvm_read_key("roam_last", &g_last, &len) ||
+		g_last >= ROAM_NETWORKS_MAX)
+		g_last = ROAM_NETWORKS_MAX;
+
+	/* NVM may hold anything, terminate the strings */
+	for (int i = 0; i < ROAM_NETWORKS_MAX; i++) {
+		g_networks[i].ssid[MAX_SSID_LEN] = '\0';
+		g_networks[i].password[MAX_PASSPHRASE_LEN - 1] = '\0';
+	}
+}
+
+/* Called with g_roam_lock held */
+static int roam_count(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ROAM_NETWORKS_MAX; i++)
+		n += g_networks[i].ssid[0] != '\0';
+
+	return n;
+}
+
+int roam_networks(void)
+{
+	int n;
+
+	xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+	n = roam_count();
+	xSemaphoreGive(g_roam_lock);
+
+	return n;
+}
+
+static int roam_find(const char *ssid, size_t len)
+{
+	for (int i = 0; i < ROAM_NETWORKS_MAX; i++) {
+		if (g_networks[i].ssid[0] &&
+			strncmp(g_networks[i].ssid, ssid, len) == 0 &&
+			g_networks[i].ssid[len] == '\0')
+			return i;
+	}
+
+	return -1;
+}
+
+static void roam_config(const struct roam_network *n, const uint8_t *bssid,
+						uint8_t channel, wifi_config_t *config)
+{
+	wifi_sta_config_init(config, n->ssid, n->password);
+
+	/* A directed connect skips the scan for the AP */
+	if (channel) {
+		config->sta.bssid_set = true;
+		memcpy(config->sta.bssid, bssid, sizeof(config->sta.bssid));
+		config->sta.channel = channel;
+	}
+}
+
+/* The last used network, aimed at the AP it was connected to */
+bool roam_last(wifi_config_t *config)
+{
+	const struct roam_network *n;
+	bool ok = false;
+
+	xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+	if (g_last < ROAM_NETWORKS_MAX && g_networks[g_last].ssid[0]) {
+		n = &g_networks[g_last];
+		roam_config(n, n->bssid, n->channel, config);
+		ok = true;
+	}
+	xSemaphoreGive(g_roam_lock);
+
+	return ok;
+}
+
+static bool roam_better(const struct roam_candidate *a,
+						const struct roam_candidate *b)
+{
+	if (a->seen != b->seen)
+		return a->seen;
+
+	if (g_networks[a->net].priority != g_networks[b->net].priority)
+		return g_networks[a->net].priority > g_networks[b->net].priority;
+
+	return a->rssi > b->rssi;
+}
+
+/*
+ * Scan once and rank the stored networks, those in range first, by
+ * priority and RSSI. Networks not found are ranked last and tried with
+ * their cached AP, they may have a hidden SSID. Returns the number of
+ * candidates for roam_candidate().
+ */
+int roam_scan(void)
+{
+	uint16_t i, num = ROAM_SCAN_MAX;
+	wifi_ap_record_t *aps;
+	int c, n = 0;
+
+	aps = malloc(num * sizeof(*aps));
+	if (!aps)
+		return 0;
+
+	g_stats.roam.scans++;
+	if (esp_wifi_scan_start(NULL, true) != ESP_OK ||
+		esp_wifi_scan_get_ap_records(&num, aps) != ESP_OK)
+		num = 0;
+
+	xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+	for (int net = 0; net < ROAM_NETWORKS_MAX; net++) {
+		struct roam_network *nw = &g_networks[net];
+		struct roam_candidate cand = { .net = net, .rssi = INT8_MIN };
+
+		if (!nw->ssid[0])
+			continue;
+
+		/* Several APs may serve the same network, take the strongest */
+		for (i = 0; i < num; i++) {
+			if (strcmp((char *)aps[i].ssid, nw->ssid) != 0 ||
+				aps[i].rssi <= cand.rssi)
+				continue;
+
+			cand.seen = true;
+			cand.rssi = aps[i].rssi;
+			cand.channel = aps[i].primary;
+			memcpy(cand.bssid, aps[i].bssid, sizeof(cand.bssid));
+		}
+
+		if (!cand.seen) {
+			cand.channel = nw->channel;
+			memcpy(cand.bssid, nw->bssid, sizeof(cand.bssid));
+		}
+
+		/* Insertion sort, there are only a few */
+		for (c = n; c > 0 && roam_better(&cand, &g_candidates[c - 1]); c--)
+			g_candidates[c] = g_candidates[c - 1];
+		g_candidates[c] = cand;
+		n++;
+	}
+	xSemaphoreGive(g_roam_lock);
+
+	free(aps);
+	return n;
+}
+
+void roam_candidate(int i, wifi_config_t *config)
+{
+	const struct roam_candidate *c = &g_candidates[i];
+
+	xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+	roam_config(&g_networks[c->net], c->bssid, c->channel, config);
+	xSemaphoreGive(g_roam_lock);
+}
+
+/* Remember the AP we got an IP address from for the next directed connect */
+static void roam_cache_ap(void)
+{
+	struct roam_network *n;
+	wifi_ap_record_t ap;
+	int net;
+
+	g_roam_connected = false;
+	if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+		return;
+
+	xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+	net = roam_find((char *)ap.ssid, strnlen((char *)ap.ssid, MAX_SSID_LEN));
+	if (net >= 0) {
+		n = &g_networks[net];
+		if (net != g_last || n->channel != ap.primary ||
+			memcmp(n->bssid, ap.bssid, sizeof(n->bssid)) != 0) {
+			g_last = net;
+			n->channel = ap.primary;
+			memcpy(n->bssid, ap.bssid, sizeof(n->bssid));
+			roam_save();
+		}
+	}
+	xSemaphoreGive(g_roam_lock);
+}
+
+/* Runs in the event loop, which shouldn't wait for NVM */
+void roam_connected(void)
+{
+	g_roam_connected = true;
+	if (g_roam_wake)
+		xSemaphoreGive(g_roam_wake);
+}
+
+/* The station gave up reconnecting to its AP */
+void roam_lost(void)
+{
+	if (g_roam_wake)
+		xSemaphoreGive(g_roam_wake);
+}
+
+/* Called with g_roam_lock held */
+static bool roam_add(const char *ssid, const char *password, uint8_t priority)
+{
+	int net = roam_find(ssid, strlen(ssid));
+
+	if (net < 0) {
+		for (net = 0; net < ROAM_NETWORKS_MAX; net++) {
+			if (!g_networks[net].ssid[0])
+				break;
+		}
+
+		if (net == ROAM_NETWORKS_MAX)
+			return false;
+
+		memset(&g_networks[net], 0, sizeof(g_networks[net]));
+		memcpy(g_networks[net].ssid, ssid,
+			   MIN(strlen(ssid), MAX_SSID_LEN));
+	}
+
+	memset(g_networks[net].password, 0, sizeof(g_networks[net].password));
+	memcpy(g_networks[net].password, password,
+		   MIN(strlen(password), MAX_PASSPHRASE_LEN - 1));
+	g_networks[net].priority = priority;
+
+	roam_save();
+	return true;
+}
+
+/* Networks applied with POST /wifi go first from now on */
+void roam_remember(const char *ssid, const char *password)
+{
+	uint8_t priority = 0;
+
+	xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+	if (roam_count()) {
+		for (int i = 0; i < ROAM_NETWORKS_MAX; i++) {
+			if (g_networks[i].ssid[0] && strcmp(g_networks[i].ssid, ssid) != 0)
+				priority = MAX(priority, g_networks[i].priority);
+		}
+
+		roam_add(ssid, password,
+				 priority < UINT8_MAX ? priority + 1 : priority);
+	}
+	xSemaphoreGive(g_roam_lock);
+}
+
+/* Called with g_roam_lock held */
+static bool roam_remove(const char *ssid)
+{
+	int net = roam_find(ssid, strlen(ssid));
+
+	if (net < 0)
+		return false;
+
+	memset(&g_networks[net], 0, sizeof(g_networks[net]));
+	if (g_last == net)
+		g_last = ROAM_NETWORKS_MAX;
+
+	roam_save();
+	return true;
+}
+
+/*
+ * Move to the best other network. With cur set the station is still
+ * connected, and only an AP clearly stronger than cur is worth it.
+ */
+static void roam_failover(const wifi_ap_record_t *cur)
+{
+	wifi_config_t config, old;
+	int64_t start = esp_timer_get_time();
+	bool tried = false;
+	int i, n;
+
+	esp_wifi_get_config(ESP_IF_WIFI_STA, &old);
+
+	n = roam_scan();
+	for (i = 0; i < n; i++) {
+		const struct roam_candidate *c = &g_candidates[i];
+
+		if (cur && (!c->seen || c->rssi < cur->rssi + ROAM_DELTA ||
+					memcmp(c->bssid, cur->bssid, sizeof(c->bssid)) == 0))
+			continue;
+
+		roam_candidate(i, &config);
+		g_stats.roam.attempts++;
+		tried = true;
+
+		if (wifi_sta_switch(&config)) {
+			g_stats.roam.failovers++;
+			g_stats.roam.last_ms = (esp_timer_get_time() - start) / 1000;
+			return;
+		}
+	}
+
+	/* Back to the weak AP rather than none */
+	if (cur && tried)
+		wifi_sta_switch(&old);
+}
+
+static void roam_task(void *arg)
+{
+	wifi_ap_record_t ap;
+	int weak = 0;
+
+	bool woken;
+
+	for (;;) {
+		/* Woken up early on a new connection or a lost AP */
+		woken = xSemaphoreTake(g_roam_wake,
+							   ROAM_PERIOD_MS / portTICK_PERIOD_MS) == pdTRUE;
+
+		if (g_roam_connected)
+			roam_cache_ap();
+
+		if (!roam_networks() || !wifi_sta_roaming())
+			continue;
+
+		if (wifi_sta_lost()) {
+			roam_failover(NULL);
+		} else if (woken) {
+			/* RSSI is sampled once per period */
+			continue;
+		} else if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK ||
+				   ap.rssi >= ROAM_RSSI) {
+			/* Good enough, or still reconnecting */
+			weak = 0;
+		} else if (++weak >= ROAM_WEAK_SAMPLES) {
+			weak = 0;
+			roam_failover(&ap);
+		}
+
+		/* Failed attempts of our own don't count as a new loss */
+		xSemaphoreTake(g_roam_wake, 0);
+		if (g_roam_connected)
+			roam_cache_ap();
+	}
+}
+
+void roam_start(void)
+{
+	if (g_roam_wake)
+		return;
+
+	g_roam_wake = binary_create(g_roam_wake);
+	task_create(roam, roam_task, "roam", NULL, 2);
+}
+
+static esp_err_t roam_list(httpd_req_t *req)
+{
+	char resp_str[128];
+
+	for (int i = 0; i < ROAM_NETWORKS_MAX; i++) {
+		const struct roam_network *n = &g_networks[i];
+		const uint8_t *b = n->bssid;
+
+		xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+		if (!n->ssid[0]) {
+			xSemaphoreGive(g_roam_lock);
+			continue;
+		}
+
+		if (n->channel)
+			snprintf(resp_str, sizeof(resp_str),
+					 "%u %s, AP %02x:%02x:%02x:%02x:%02x:%02x channel %u%s\n",
+					 n->priority, n->ssid, b[0], b[1], b[2], b[3], b[4], b[5],
+					 n->channel, i == g_last ? ", last used" : "");
+		else
+			snprintf(resp_str, sizeof(resp_str), "%u %s\n", n->priority,
+					 n->ssid);
+		xSemaphoreGive(g_roam_lock);
+
+		httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+	}
+
+	httpd_resp_send_chunk(req, NULL, 0);
+	return ESP_OK;
+}
+
+esp_err_t roam_endpoint(httpd_req_t *req)
+{
+	int ret, len = req->content_len;
+	char buf[8 + MAX_SSID_LEN + MAX_PASSPHRASE_LEN + 3];
+	char *prio, *ssid, *password, *save;
+	const char *str;
+
+	if (req->method == HTTP_GET)
+		return roam_list(req);
+
+	ret = httpd_req_recv(req, buf, MIN(len, sizeof(buf) - 1));
+	if (ret <= 0) {
+		if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+			httpd_resp_send_408(req);
+		return ESP_FAIL;
+	}
+
+	buf[ret] = '\0';
+	prio = strtok_r(buf, "\r\n", &save);
+	ssid = strtok_r(NULL, "\r\n", &save);
+	password = strtok_r(NULL, "\r\n", &save);
+
+	if (!prio || !ssid || strlen(ssid) > MAX_SSID_LEN ||
+		(password && strlen(password) >= MAX_PASSPHRASE_LEN)) {
+		str = "Expecting priority, SSID and password on separate lines\n";
+		httpd_resp_send(req, str, strlen(str));
+		return ESP_OK;
+	}
+
+	xSemaphoreTake(g_roam_lock, portMAX_DELAY);
+	if (strcmp(prio, "remove") == 0)
+		str = roam_remove(ssid) ? "OK\n" : "No such network\n";
+	else if (!roam_add(ssid, password ? password : "", strtoul(prio, NULL, 10)))
+		str = "Too many networks\n";
+	else
+		str = "OK\n";
+	xSemaphoreGive(g_roam_lock);
+
+	httpd_resp_send(req, str, strlen(str));
+	return ESP_OK;
+}
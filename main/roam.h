@@ -0,0 +1,34 @@
+#ifndef __ROAM_H__
+#define __ROAM_H__
+
+#include <stdbool.h>
+
+#include <esp_wifi_types.h>
+#include <esp_http_server.h>
+
+#define ROAM_NETWORKS_MAX 4
+
+#ifdef CONFIG_BRIDGE_ROAM
+void roam_init(void);
+void roam_start(void);
+int roam_networks(void);
+bool roam_last(wifi_config_t *config);
+int roam_scan(void);
+void roam_candidate(int i, wifi_config_t *config);
+void roam_connected(void);
+void roam_lost(void);
+void roam_remember(const char *ssid, const char *password);
+esp_err_t roam_endpoint(httpd_req_t *req);
+#else
+static inline void roam_init(void) { }
+static inline void roam_start(void) { }
+static inline int roam_networks(void) { return 0; }
+static inline bool roam_last(wifi_config_t *config) { return false; }
+static inline int roam_scan(void) { return 0; }
+static inline void roam_candidate(int i, wifi_config_t *config) { }
+static inline void roam_connected(void) { }
+static inline void roam_lost(void) { }
+static inline void roam_remember(const char *ssid, const char *password) { }
+#endif
+
+#endif /* __ROAM_H__ */
@@ -0,0 +1,377 @@
+/* UART loopback self-test
+
+   POST /selftest loops UART0 back onto itself, either internally or
+   through a TX/RX jumper, and connects to the bridge port from the device
+   itself. Data sent on that connection takes the whole bridge path: the
+   w2u task writes it to the UART, it comes back on RX and the u2w task
+   sends it back. The test repeats this at rising baud rates until data is
+   lost, and measures for every rate:
+   - the payload throughput and the bytes lost or corrupted
+   - the CPU load, if FreeRTOS collects run time stats
+   - the latency of a small probe in every stage of the path
+
+   The connection runs over the lwIP loopback interface, so the WiFi
+   stages measure the device's network stack but not the radio, see
+   GET /rtt for that. The result is stored in NVM and returned by
+   GET /selftest, also after a reboot.
+
+   The test needs the bridge port to itself, it refuses to run with a
+   client connected or the line filter on. The UART TX pin carries the
+   test data while it runs.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include <driver/uart.h>
+#include <esp8266/uart_struct.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <lwip/sockets.h>
+
+#include "filter.h"
+#include "mem.h"
+#include "nvm.h"
+#include "selftest.h"
+#include "stats.h"
+
+#define SELFTEST_PORT 8888		/* The bridge port */
+#define SELFTEST_BYTES 8192		/* Sent through the loop per baud rate */
+#define SELFTEST_PROBE 16
+
+static const uint32_t selftest_bauds[SELFTEST_STEPS] = {
+	115200, 230400, 460800, 921600, 1500000, 2000000
+};
+
+static const char *stage_names[SELFTEST_STAGES + 1] = {
+	"wifi rx", "uart tx", "uart rx", "wifi tx"
+};
+
+bool bridge_client_connected(void);
+
+volatile bool g_selftest_probe;
+static int64_t g_selftest_stamps[SELFTEST_STAGES];
+
+static struct selftest_result g_result;
+static bool g_result_loaded;
+static char g_selftest_status[48] = "not run\n";
+static volatile bool g_selftest_busy;
+
+static uint8_t g_tx_chunk[SELFTEST_CHUNK];
+static uint8_t g_rx_chunk[SELFTEST_CHUNK];
+
+static SemaphoreHandle_t g_selftest_start = NULL;
+SEMAPHORE_DEFINE(g_selftest_start);
+TASK_DEFINE(selftest, BRIDGE_STACK_SELFTEST);
+
+/* Only the first pass of the probe through each stage counts */
+void selftest_stamp_slow(enum selftest_stage stage)
+{
+	if (!g_selftest_stamps[stage])
+		g_selftest_stamps[stage] = esp_timer_get_time();
+}
+
+static uint8_t pattern(size_t offs)
+{
+	return offs * 31 + (offs >> 8);
+}
+
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+static bool cpu_sample(uint32_t *idle, uint32_t *total)
+{
+	UBaseType_t i, n = uxTaskGetNumberOfTasks();
+	TaskStatus_t *tasks;
+
+	tasks = malloc(n * sizeof(*tasks));
+	if (!tasks)
+		return false;
+
+	n = uxTaskGetSystemState(tasks, n, total);
+
+	*idle = 0;
+	for (i = 0; i < n; i++) {
+		if (strcmp(tasks[i].pcTaskName, "IDLE") == 0)
+			*idle = tasks[i].ulRunTimeCounter;
+	}
+
+	free(tasks);
+	return n != 0;
+}
+#else
+static bool cpu_sample(uint32_t *idle, uint32_t *total)
+{
+	return false;
+}
+#endif
+
+static void selftest_drain(int sock)
+{
+	vTaskDelay(50 / portTICK_PERIOD_MS);
+
+	while (recv(sock, g_rx_chunk, sizeof(g_rx_chunk), MSG_DONTWAIT) > 0)
+		;
+}
+
+static void selftest_latency(int sock, struct selftest_step *st)
+{
+	uint8_t probe[SELFTEST_PROBE];
+	int64_t start, end, *t = g_selftest_stamps;
+	ssize_t n;
+	size_t got;
+
+	memset(probe, 0x55, sizeof(probe));
+	memset(g_selftest_stamps, 0, sizeof(g_selftest_stamps));
+	g_selftest_probe = true;
+
+	start = esp_timer_get_time();
+	send(sock, probe, sizeof(probe), 0);
+
+	for (got = 0; got < sizeof(probe); got += n) {
+		n = recv(sock, g_rx_chunk, sizeof(probe) - got, 0);
+		if (n <= 0)
+			break;
+	}
+
+	end = esp_timer_get_time();
+	g_selftest_probe = false;
+
+	if (got < sizeof(probe) || !t[0] || !t[1] || !t[2])
+		return;
+
+	st->stage_us[0] = t[0] - start;
+	st->stage_us[1] = t[1] - t[0];
+	st->stage_us[2] = t[2] - t[1];
+	st->stage_us[3] = end - t[2];
+}
+
+/* Returns whether all data came back intact */
+static bool selftest_step(int sock, struct selftest_step *st)
+{
+	uint32_t errors = g_stats.bridge.fifo_ovf + g_stats.bridge.buffer_full;
+	uint32_t idle0, idle1, total0, total1;
+	size_t i, sent = 0, recvd = 0, good = 0;
+	int64_t start, deadline;
+	bool cpu;
+	ssize_t n;
+
+	uart_set_baudrate(UART_NUM_0, st->baud);
+	selftest_drain(sock);
+	selftest_latency(sock, st);
+
+	cpu = cpu_sample(&idle0, &total0);
+
+	/* Four times the time on the wire, at 10 bits per byte */
+	start = esp_timer_get_time();
+	deadline = start + 1000000 +
+			   4 * (int64_t)SELFTEST_BYTES * 10 * 1000000 / st->baud;
+
+	while (recvd < SELFTEST_BYTES && esp_timer_get_time() < deadline) {
+		bool idle = true;
+
+		if (sent < SELFTEST_BYTES) {
+			size_t len = MIN(sizeof(g_tx_chunk), SELFTEST_BYTES - sent);
+
+			for (i = 0; i < len; i++)
+				g_tx_chunk[i] = pattern(sent + i);
+
+			n = send(sock, g_tx_chunk, len, MSG_DONTWAIT);
+			if (n > 0) {
+				sent += n;
+				idle = false;
+			}
+		}
+
+		n = recv(sock, g_rx_chunk, sizeof(g_rx_chunk), MSG_DONTWAIT);
+		for (i = 0; n > 0 && i < n; i++, recvd++) {
+			if (good == recvd && g_rx_chunk[i] == pattern(recvd))
+				good++;
+			idle = false;
+		}
+
+		if (idle)
+			vTaskDelay(1);
+	}
+
+	st->kbps = good * 8000 / MAX(esp_timer_get_time() - start, 1);
+	st->lost = SELFTEST_BYTES - good;
+
+	st->load = -1;
+	if (cpu && cpu_sample(&idle1, &total1) && total1 != total0)
+		st->load = 100 - (uint64_t)(idle1 - idle0) * 100 / (total1 - total0);
+
+	errors = g_stats.bridge.fifo_ovf + g_stats.bridge.buffer_full - errors;
+
+	return !st->lost && !errors;
+}
+
+static int selftest_connect(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(SELFTEST_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct timeval tv = { .tv_sec = 1 };
+	int sock, wait;
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+	if (sock < 0)
+		return -1;
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(sock);
+		return -1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* Wait until the bridge took the connection as its client */
+	for (wait = 0; wait < 100 && !bridge_client_connected(); wait++)
+		vTaskDelay(10 / portTICK_PERIOD_MS);
+
+	return sock;
+}
+
+static void selftest_run(void)
+{
+	struct selftest_result *r = &g_result;
+	uint32_t baud = 115200;
+	int sock, i;
+
+	sock = selftest_connect();
+	if (sock < 0) {
+		snprintf(g_selftest_status, sizeof(g_selftest_status),
+				 "failed to connect\n");
+		return;
+	}
+
+	/* Log output on UART0 would end up in the loop */
+	esp_log_level_set("*", ESP_LOG_NONE);
+	uart_get_baudrate(UART_NUM_0, &baud);
+#ifndef CONFIG_BRIDGE_SELFTEST_JUMPER
+	uart0.conf0.loopback = 1;
+#endif
+
+	memset(r, 0, sizeof(*r));
+
+	for (i = 0; i < SELFTEST_STEPS; i++) {
+		struct selftest_step *st = &r->step[i];
+
+		st->baud = selftest_bauds[i];
+		r->steps++;
+
+		if (!selftest_step(sock, st))
+			break;
+
+		r->max_baud = st->baud;
+	}
+
+#ifndef CONFIG_BRIDGE_SELFTEST_JUMPER
+	uart0.conf0.loopback = 0;
+#endif
+	uart_set_baudrate(UART_NUM_0, baud);
+	esp_log_level_set("*", CONFIG_LOG_DEFAULT_LEVEL);
+
+	close(sock);
+
+	g_result_loaded = true;
+	nvm_write_key("selftest", (uint8_t *)r, sizeof(*r));
+	snprintf(g_selftest_status, sizeof(g_selftest_status), "done\n");
+}
+
+static void selftest_task(void *arg)
+{
+	for (;;) {
+		xSemaphoreTake(g_selftest_start, portMAX_DELAY);
+		selftest_run();
+		g_selftest_busy = false;
+	}
+}
+
+esp_err_t selftest_start_endpoint(httpd_req_t *req)
+{
+	const char *str = "Started\n";
+
+	if (g_selftest_busy) {
+		str = "Already running\n";
+	} else if (bridge_client_connected()) {
+		str = "Disconnect the bridge client first\n";
+	} else if (filter_active()) {
+		str = "Turn the line filter off first\n";
+	} else {
+		if (!g_selftest_start) {
+			g_selftest_start = binary_create(g_selftest_start);
+			task_create(selftest, selftest_task, "selftest", NULL, 2);
+		}
+
+		g_selftest_busy = true;
+		snprintf(g_selftest_status, sizeof(g_selftest_status), "running\n");
+		xSemaphoreGive(g_selftest_start);
+	}
+
+	httpd_resp_send(req, str, strlen(str));
+	return ESP_OK;
+}
+
+esp_err_t selftest_endpoint(httpd_req_t *req)
+{
+	const struct selftest_result *r = &g_result;
+	char resp_str[160];
+	uint32_t i, s;
+	int len;
+
+	if (!g_result_loaded && !g_selftest_busy) {
+		size_t size = sizeof(g_result);
+
+		if (nvm_read_key("selftest", (uint8_t *)&g_result, &size) &&
+			size == sizeof(g_result) && g_result.steps <= SELFTEST_STEPS)
+			snprintf(g_selftest_status, sizeof(g_selftest_status),
+					 "stored\n");
+		else
+			memset(&g_result, 0, sizeof(g_result));
+
+		g_result_loaded = true;
+	}
+
+	snprintf(resp_str, sizeof(resp_str), "Self-test: %s", g_selftest_status);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+
+	if (g_selftest_busy || !r->steps) {
+		httpd_resp_send_chunk(req, NULL, 0);
+		return ESP_OK;
+	}
+
+	snprintf(resp_str, sizeof(resp_str), "Highest lossless baud rate: %u\n",
+			 r->max_baud);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+
+	for (i = 0; i < r->steps; i++) {
+		const struct selftest_step *st = &r->step[i];
+
+		len = snprintf(resp_str, sizeof(resp_str),
+					   "%u baud: %u kbit/s, lost %u, CPU ", st->baud, st->kbps,
+					   st->lost);
+		if (st->load < 0)
+			len += snprintf(&resp_str[len], sizeof(resp_str) - len, "n/a");
+		else
+			len += snprintf(&resp_str[len], sizeof(resp_str) - len, "%d%%",
+							st->load);
+
+		for (s = 0; s <= SELFTEST_STAGES; s++)
+			len += snprintf(&resp_str[len], sizeof(resp_str) - len,
+							", %s %u us", stage_names[s], st->stage_us[s]);
+
+		snprintf(&resp_str[len], sizeof(resp_str) - len, "\n");
+		httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+	}
+
+	httpd_resp_send_chunk(req, NULL, 0);
+	return ESP_OK;
+}
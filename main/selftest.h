@@ -0,0 +1,52 @@
+#ifndef __SELFTEST_H__
+#define __SELFTEST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <esp_http_server.h>
+
+/* Points of the bridge path a latency probe passes, in order */
+enum selftest_stage {
+	SELFTEST_WIFI_RX,		/* Data from the client arrived */
+	SELFTEST_UART_TX,		/* Data handed to the UART */
+	SELFTEST_UART_RX,		/* Data read back from the UART */
+	SELFTEST_STAGES,
+};
+
+#define SELFTEST_CHUNK 256		/* Transfer chunk, one each way */
+#define SELFTEST_STEPS 6		/* Baud rates tried */
+
+struct selftest_step {
+	uint32_t baud;
+	uint32_t lost;			/* Bytes missing or corrupted */
+	uint32_t kbps;			/* Payload throughput */
+	int32_t load;			/* CPU load in percent, -1 if unknown */
+	uint32_t stage_us[SELFTEST_STAGES + 1];	/* Probe latency per stage */
+};
+
+/* Persisted in NVM, see GET /selftest */
+struct selftest_result {
+	uint32_t steps;
+	uint32_t max_baud;		/* Highest lossless rate, 0 if none */
+	struct selftest_step step[SELFTEST_STEPS];
+};
+
+#ifdef CONFIG_BRIDGE_SELFTEST
+extern volatile bool g_selftest_probe;
+void selftest_stamp_slow(enum selftest_stage stage);
+
+/* Costs one load while no probe is in flight */
+static inline void selftest_stamp(enum selftest_stage stage)
+{
+	if (g_selftest_probe)
+		selftest_stamp_slow(stage);
+}
+
+esp_err_t selftest_endpoint(httpd_req_t *req);
+esp_err_t selftest_start_endpoint(httpd_req_t *req);
+#else
+static inline void selftest_stamp(enum selftest_stage stage) { }
+#endif
+
+#endif /* __SELFTEST_H__ */
@@ -0,0 +1,275 @@
+/* Bridge statistics and benchmarks
+
+   GET /stats reports the counters collected by the bridge. GET /rtt pings
+   the default gateway and stores the round trip time under the active
+   power save profile, so running it once per profile shows what each
+   profile costs in latency.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_system.h>
+#include <esp_timer.h>
+
+#include <lwip/sockets.h>
+#include <lwip/icmp.h>
+#include <lwip/inet_chksum.h>
+#include <lwip/ip.h>
+
+#include "stats.h"
+#include "wifi.h"
+#include "mem.h"
+#include "link.h"
+
+#define RTT_PROBES 8
+#define RTT_TIMEOUT_MS 1000
+#define RTT_ID 0xb71d
+
+struct bridge_stats g_stats;
+
+static bool rtt_ping(int sock, uint32_t gw, uint16_t seq, uint32_t *rtt_us)
+{
+	struct sockaddr_in to = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = gw
+	};
+	struct icmp_echo_hdr req, *rsp;
+	struct ip_hdr *iph;
+	uint8_t buf[64];
+	int64_t start;
+	ssize_t len;
+
+	memset(&req, 0, sizeof(req));
+	req.type = ICMP_ECHO;
+	req.id = RTT_ID;
+	req.seqno = htons(seq);
+	req.chksum = inet_chksum(&req, sizeof(req));
+
+	start = esp_timer_get_time();
+
+	len = sendto(sock, &req, sizeof(req), 0, (struct sockaddr *)&to, sizeof(to));
+	if (len != sizeof(req))
+		return false;
+
+	for (;;) {
+		len = recv(sock, buf, sizeof(buf), 0);
+		if (len <= 0)
+			return false;
+
+		/* Raw sockets return the IP header as well */
+		iph = (struct ip_hdr *)buf;
+		if (len < IPH_HL(iph) * 4 + sizeof(*rsp))
+			continue;
+
+		rsp = (struct icmp_echo_hdr *)&buf[IPH_HL(iph) * 4];
+		if (rsp->type == ICMP_ER && rsp->id == RTT_ID &&
+			rsp->seqno == htons(seq))
+			break;
+	}
+
+	*rtt_us = esp_timer_get_time() - start;
+	return true;
+}
+
+static bool rtt_probe(struct rtt_stats *rtt)
+{
+	struct timeval tv = {
+		.tv_sec = RTT_TIMEOUT_MS / 1000,
+		.tv_usec = (RTT_TIMEOUT_MS % 1000) * 1000
+	};
+	uint32_t gw, us, total = 0;
+	int sock;
+
+	if (!wifi_get_gateway(&gw))
+		return false;
+
+	sock = socket(AF_INET, SOCK_RAW, IP_PROTO_ICMP);
+	if (sock < 0)
+		return false;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(rtt, 0, sizeof(*rtt));
+	rtt->min_us = UINT32_MAX;
+
+	for (uint16_t seq = 0; seq < RTT_PROBES; seq++) {
+
+		rtt->sent++;
+		if (!rtt_ping(sock, gw, seq, &us)) {
+			rtt->lost++;
+			continue;
+		}
+
+		total += us;
+		rtt->min_us = MIN(rtt->min_us, us);
+		rtt->max_us = MAX(rtt->max_us, us);
+
+		vTaskDelay(100 / portTICK_PERIOD_MS);
+	}
+
+	close(sock);
+
+	if (rtt->lost == rtt->sent) {
+		rtt->min_us = 0;
+		return true;
+	}
+
+	rtt->avg_us = total / (rtt->sent - rtt->lost);
+	return true;
+}
+
+static int format_rtt(char *buf, size_t len, const char *name,
+					  const struct rtt_stats *rtt)
+{
+	return snprintf(buf, len,
+					"RTT %s: sent %u, lost %u, min %u us, avg %u us, max %u us\n",
+					name, rtt->sent, rtt->lost, rtt->min_us, rtt->avg_us,
+					rtt->max_us);
+}
+
+esp_err_t rtt_endpoint(httpd_req_t *req)
+{
+	wifi_power_profile_t profile = wifi_get_power_profile();
+	struct rtt_stats *rtt = &g_stats.rtt[profile];
+	char resp_str[128];
+
+	if (!rtt_probe(rtt)) {
+		const char *str = "Can't reach gateway\n";
+		httpd_resp_send(req, str, strlen(str));
+		return ESP_OK;
+	}
+
+	format_rtt(resp_str, sizeof(resp_str), wifi_power_profile_name(profile),
+			   rtt);
+	httpd_resp_send(req, resp_str, strlen(resp_str));
+	return ESP_OK;
+}
+
+esp_err_t stats_endpoint(httpd_req_t *req)
+{
+	const struct data_stats *b = &g_stats.bridge;
+	char resp_str[192];
+
+	snprintf(resp_str, sizeof(resp_str),
+			 "UART rx %u, WiFi tx %u, UART tx %u\n"
+			 "Dropped no client %u, send %u, overflow %u\n",
+			 b->uart_rx, b->wifi_tx, b->uart_tx, b->dropped_no_client,
+			 b->dropped_send, b->dropped_overflow);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+
+	snprintf(resp_str, sizeof(resp_str),
+			 "Send retries %u, retransmits %u, FIFO overflow %u, "
+			 "buffer full %u, parity %u, frame %u\n"
+			 "Clients %u, rejected %u, evicted %u, idle %u, auth failed %u\n",
+			 b->send_retries, b->retransmits, b->fifo_ovf, b->buffer_full,
+			 b->parity_err, b->frame_err, b->clients, b->rejected,
+			 b->evicted, b->idle_closed, b->auth_failed);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+
+#ifdef CONFIG_BRIDGE_FILTER
+	const struct filter_stats *f = &g_stats.filter;
+
+	snprintf(resp_str, sizeof(resp_str),
+			 "Filter lines %u, dropped %u bytes, triggers %u, "
+			 "notify failed %u\n",
+			 f->lines, f->dropped, f->triggers, f->notify_failed);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+#endif
+
+#ifdef CONFIG_BRIDGE_LINK_ADAPT
+	const struct link_stats *l = &g_stats.link;
+
+	snprintf(resp_str, sizeof(resp_str),
+			 "Link %s, RSSI %d dBm, send failures %u, changes %u\n",
+			 link_level_name(l->level), l->rssi, l->failures, l->changes);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+
+	for (uint32_t i = l->changes > LINK_DECISIONS ?
+					  l->changes - LINK_DECISIONS : 0;
+		 i < l->changes; i++) {
+		const struct link_decision *d = &l->log[i % LINK_DECISIONS];
+
+		snprintf(resp_str, sizeof(resp_str),
+				 "Link at %u s: %s to %s, RSSI %d dBm, send failures %u\n",
+				 d->time, link_level_name(d->from), link_level_name(d->to),
+				 d->rssi, d->failures);
+		httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+	}
+#endif
+
+#ifdef CONFIG_BRIDGE_ROAM
+	const struct roam_stats *r = &g_stats.roam;
+
+	snprintf(resp_str, sizeof(resp_str),
+			 "Roaming scans %u, failovers %u of %u (last %u ms)\n",
+			 r->scans, r->failovers, r->attempts, r->last_ms);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+#endif
+
+#ifdef CONFIG_BRIDGE_TLS
+	const struct tls_stats *t = &g_stats.tls;
+
+	snprintf(resp_str, sizeof(resp_str),
+			 "TLS full %u (last %u us), resumed %u (last %u us), failed %u, "
+			 "RAM per connection %u\n",
+			 t->full, t->full_us, t->resumed, t->resumed_us, t->failed,
+			 t->conn_ram);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+#endif
+
+	snprintf(resp_str, sizeof(resp_str), "Power profile: %s\n",
+			 wifi_power_profile_name(wifi_get_power_profile()));
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+
+	const struct mem_usage *u;
+	uint32_t total = mem_budget(&u);
+
+	for (; u->name; u++) {
+		snprintf(resp_str, sizeof(resp_str), "RAM %s: %u bytes\n", u->name,
+				 u->bytes);
+		httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+	}
+
+	snprintf(resp_str, sizeof(resp_str),
+			 "RAM total: %u bytes, heap free %u, lowest %u\n"
+			 "Heap after connect/OTA: samples %u, first %u, last %u, lowest %u\n",
+			 total, esp_get_free_heap_size(), esp_get_minimum_free_heap_size(),
+			 g_stats.heap.samples, g_stats.heap.first, g_stats.heap.last,
+			 g_stats.heap.lowest);
+	httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+
+#if configUSE_TRACE_FACILITY
+	/* Unused stack of every task since boot, to size the Memory budget */
+	UBaseType_t n = uxTaskGetNumberOfTasks();
+	TaskStatus_t *tasks = malloc(n * sizeof(*tasks));
+
+	if (tasks) {
+		n = uxTaskGetSystemState(tasks, n, NULL);
+		for (UBaseType_t i = 0; i < n; i++) {
+			snprintf(resp_str, sizeof(resp_str), "Stack left %s: %u\n",
+					 tasks[i].pcTaskName, tasks[i].usStackHighWaterMark);
+			httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+		}
+		free(tasks);
+	}
+#endif
+
+	for (int i = 0; i < WIFI_POWER_MAX; i++) {
+		if (!g_stats.rtt[i].sent)
+			continue;
+
+		format_rtt(resp_str, sizeof(resp_str), wifi_power_profile_name(i),
+				   &g_stats.rtt[i]);
+		httpd_resp_send_chunk(req, resp_str, strlen(resp_str));
+	}
+
+	// End response
+	httpd_resp_send_chunk(req, NULL, 0);
+	return ESP_OK;
+}
@@ -0,0 +1,105 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+#include <esp_http_server.h>
+
+#include "wifi.h"
+
+struct rtt_stats {
+	uint32_t sent;
+	uint32_t lost;
+	uint32_t min_us;
+	uint32_t avg_us;
+	uint32_t max_us;
+};
+
+struct heap_stats {
+	uint32_t samples;
+	uint32_t first;
+	uint32_t last;
+	uint32_t lowest;
+};
+
+struct data_stats {
+	uint32_t uart_rx;			/* Bytes read from the UART */
+	uint32_t wifi_tx;			/* Bytes sent to the bridge client */
+	uint32_t uart_tx;			/* Bytes from the client written to the UART */
+	uint32_t dropped_no_client;	/* UART bytes flushed without a client */
+	uint32_t dropped_send;		/* UART bytes lost with a failed client */
+	uint32_t dropped_overflow;	/* UART bytes flushed after an overflow */
+	uint32_t send_retries;
+	uint32_t retransmits;		/* TCP retransmissions to the client */
+	uint32_t fifo_ovf;
+	uint32_t buffer_full;
+	uint32_t parity_err;
+	uint32_t frame_err;
+	uint32_t clients;
+	uint32_t rejected;
+	uint32_t evicted;			/* Clients replaced by a new connection */
+	uint32_t idle_closed;		/* Clients closed by the idle timeout */
+	uint32_t auth_failed;
+};
+
+struct tls_stats {
+	uint32_t full;			/* Handshakes with key exchange */
+	uint32_t resumed;		/* Handshakes resuming a session ticket */
+	uint32_t failed;
+	uint32_t full_us;		/* Duration of the last full handshake */
+	uint32_t resumed_us;	/* Duration of the last resumed handshake */
+	uint32_t conn_ram;		/* Heap used by the last TLS connection */
+};
+
+struct filter_stats {
+	uint32_t lines;
+	uint32_t dropped;			/* UART bytes in lines filtered out */
+	uint32_t triggers;
+	uint32_t notify_failed;
+};
+
+#define LINK_DECISIONS 8
+
+struct link_decision {
+	uint32_t time;			/* Seconds since boot */
+	int8_t rssi;
+	uint8_t from;			/* link_level_t */
+	uint8_t to;
+	uint16_t failures;		/* Retransmissions, plus 5 if data was dropped */
+};
+
+struct link_stats {
+	int32_t rssi;			/* Smoothed RSSI of the last sample */
+	uint32_t failures;		/* Of the last sample period */
+	uint32_t level;
+	uint32_t changes;
+	struct link_decision log[LINK_DECISIONS];	/* Last changes, ring */
+};
+
+struct roam_stats {
+	uint32_t scans;
+	uint32_t attempts;		/* Background failovers tried */
+	uint32_t failovers;		/* Of which succeeded */
+	uint32_t last_ms;		/* Duration of the last failover */
+};
+
+struct bridge_stats {
+	struct data_stats bridge;
+	struct tls_stats tls;
+	struct filter_stats filter;
+	struct link_stats link;
+	struct roam_stats roam;
+
+	/* Free heap after every WiFi (re)connect and OTA upgrade */
+	struct heap_stats heap;
+
+	/* Gateway round trip time, last probe per power save profile */
+	struct rtt_stats rtt[WIFI_POWER_MAX];
+};
+
+extern struct bridge_stats g_stats;
+
+esp_err_t stats_endpoint(httpd_req_t *req);
+esp_err_t rtt_endpoint(httpd_req_t *req);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,314 @@
+/* TLS for the bridge port
+
+   Clients authenticate with a pre-shared key, so no certificate and no
+   asymmetric crypto is needed, and reconnecting clients can resume their
+   session with a session ticket, which skips the key exchange altogether.
+
+   The u2w and w2u tasks use the same connection concurrently, so every
+   connection has a lock around mbedtls_ssl_read() and mbedtls_ssl_write().
+   tls_recv() waits for data without the lock and reads without blocking,
+   so a quiet client never stalls the sending side.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sdkconfig.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+
+#include <lwip/sockets.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/net_sockets.h>
+
+#include "tls.h"
+#include "stats.h"
+
+#if !defined(MBEDTLS_KEY_EXCHANGE_PSK_ENABLED)
+#error "CONFIG_BRIDGE_TLS needs PSK key exchange enabled in mbedTLS"
+#endif
+
+#define TLS_HANDSHAKE_TIMEOUT 5
+#define TLS_TICKET_LIFETIME (24 * 3600)
+#define TLS_RECV_WAIT_MS 1000
+
+struct tls_conn {
+	mbedtls_ssl_context ssl;
+	SemaphoreHandle_t lock;
+	int sock;
+	bool nonblock;
+};
+
+static const char *TAG = "tls";
+
+static const int tls_ciphersuites[] = {
+	MBEDTLS_TLS_PSK_WITH_AES_128_GCM_SHA256,
+	MBEDTLS_TLS_PSK_WITH_AES_128_CBC_SHA256,
+	0
+};
+
+static mbedtls_entropy_context g_entropy;
+static mbedtls_ctr_drbg_context g_ctr_drbg;
+static mbedtls_ssl_config g_conf;
+static bool g_tls_ready;
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+static mbedtls_ssl_ticket_context g_ticket;
+static bool g_resumed;
+
+/* A ticket that parses means the client resumes its previous session */
+static int tls_ticket_parse(void *ctx, mbedtls_ssl_session *session,
+							unsigned char *buf, size_t len)
+{
+	int ret = mbedtls_ssl_ticket_parse(ctx, session, buf, len);
+
+	g_resumed = ret == 0;
+	return ret;
+}
+#endif
+
+static int tls_bio_send(void *ctx, const unsigned char *buf, size_t len)
+{
+	struct tls_conn *conn = ctx;
+	int ret;
+
+	ret = send(conn->sock, buf, len, 0);
+	if (ret < 0)
+		return MBEDTLS_ERR_NET_SEND_FAILED;
+
+	return ret;
+}
+
+static int tls_bio_recv(void *ctx, unsigned char *buf, size_t len)
+{
+	struct tls_conn *conn = ctx;
+	int ret;
+
+	ret = recv(conn->sock, buf, len, conn->nonblock ? MSG_DONTWAIT : 0);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return MBEDTLS_ERR_SSL_WANT_READ;
+		return MBEDTLS_ERR_NET_RECV_FAILED;
+	}
+
+	return ret;
+}
+
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static size_t parse_psk(const char *hex, unsigned char *psk, size_t size)
+{
+	size_t len = 0;
+	int hi, lo;
+
+	while (hex[0] && hex[1] && len < size) {
+		hi = hex_nibble(hex[0]);
+		lo = hex_nibble(hex[1]);
+		if (hi < 0 || lo < 0)
+			return 0;
+
+		psk[len++] = hi << 4 | lo;
+		hex += 2;
+	}
+
+	return hex[0] ? 0 : len;
+}
+
+bool tls_init(void)
+{
+	const char *identity = CONFIG_BRIDGE_TLS_PSK_IDENTITY;
+	unsigned char psk[MBEDTLS_PSK_MAX_LEN];
+	size_t psk_len;
+	int ret;
+
+	psk_len = parse_psk(CONFIG_BRIDGE_TLS_PSK, psk, sizeof(psk));
+	if (!psk_len) {
+		ESP_LOGE(TAG, "invalid PSK, bridge clients will be refused");
+		return false;
+	}
+
+	mbedtls_entropy_init(&g_entropy);
+	mbedtls_ctr_drbg_init(&g_ctr_drbg);
+	mbedtls_ssl_config_init(&g_conf);
+
+	ret = mbedtls_ctr_drbg_seed(&g_ctr_drbg, mbedtls_entropy_func, &g_entropy,
+								NULL, 0);
+	if (ret != 0)
+		return false;
+
+	ret = mbedtls_ssl_config_defaults(&g_conf, MBEDTLS_SSL_IS_SERVER,
+									  MBEDTLS_SSL_TRANSPORT_STREAM,
+									  MBEDTLS_SSL_PRESET_DEFAULT);
+	if (ret != 0)
+		return false;
+
+	mbedtls_ssl_conf_rng(&g_conf, mbedtls_ctr_drbg_random, &g_ctr_drbg);
+	mbedtls_ssl_conf_ciphersuites(&g_conf, tls_ciphersuites);
+
+	ret = mbedtls_ssl_conf_psk(&g_conf, psk, psk_len,
+							   (const unsigned char *)identity,
+							   strlen(identity));
+	if (ret != 0)
+		return false;
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_init(&g_ticket);
+	ret = mbedtls_ssl_ticket_setup(&g_ticket, mbedtls_ctr_drbg_random,
+								   &g_ctr_drbg, MBEDTLS_CIPHER_AES_128_GCM,
+								   TLS_TICKET_LIFETIME);
+	if (ret == 0)
+		mbedtls_ssl_conf_session_tickets_cb(&g_conf, mbedtls_ssl_ticket_write,
+											tls_ticket_parse, &g_ticket);
+#else
+	ESP_LOGW(TAG, "session tickets disabled in mbedTLS, no resumption");
+#endif
+
+	g_tls_ready = true;
+	return true;
+}
+
+struct tls_conn *tls_accept(int sock)
+{
+	struct timeval tv = { .tv_sec = TLS_HANDSHAKE_TIMEOUT };
+	struct timeval restore = { 0 };
+	socklen_t optlen = sizeof(restore);
+	struct tls_stats *stats = &g_stats.tls;
+	struct tls_conn *conn;
+	uint32_t heap;
+	int64_t start;
+	int ret;
+
+	if (!g_tls_ready)
+		return NULL;
+
+	heap = esp_get_free_heap_size();
+	start = esp_timer_get_time();
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+
+	conn->sock = sock;
+	conn->lock = xSemaphoreCreateMutex();
+	mbedtls_ssl_init(&conn->ssl);
+
+	if (!conn->lock || mbedtls_ssl_setup(&conn->ssl, &g_conf) != 0)
+		goto fail;
+
+	mbedtls_ssl_set_bio(&conn->ssl, conn, tls_bio_send, tls_bio_recv, NULL);
+
+	/* Don't let a silent client block the accept loop */
+	getsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &restore, &optlen);
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	g_resumed = false;
+#endif
+
+	ret = mbedtls_ssl_handshake(&conn->ssl);
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &restore, sizeof(restore));
+
+	if (ret != 0) {
+		ESP_LOGW(TAG, "handshake failed: -0x%x", -ret);
+		goto fail;
+	}
+
+	conn->nonblock = true;
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	if (g_resumed) {
+		stats->resumed++;
+		stats->resumed_us = esp_timer_get_time() - start;
+	} else
+#endif
+	{
+		stats->full++;
+		stats->full_us = esp_timer_get_time() - start;
+	}
+
+	stats->conn_ram = heap - esp_get_free_heap_size();
+	return conn;
+
+fail:
+	stats->failed++;
+	tls_free(conn);
+	return NULL;
+}
+
+ssize_t tls_send(struct tls_conn *conn, const void *buf, size_t len)
+{
+	int ret;
+
+	xSemaphoreTake(conn->lock, portMAX_DELAY);
+	ret = mbedtls_ssl_write(&conn->ssl, buf, len);
+	xSemaphoreGive(conn->lock);
+
+	return ret < 0 ? -1 : ret;
+}
+
+/* Returns -1 with errno EAGAIN if no data arrived within TLS_RECV_WAIT_MS */
+ssize_t tls_recv(struct tls_conn *conn, void *buf, size_t len)
+{
+	struct timeval tv = { .tv_sec = TLS_RECV_WAIT_MS / 1000 };
+	fd_set fds;
+	int ret;
+
+	if (!mbedtls_ssl_get_bytes_avail(&conn->ssl)) {
+		FD_ZERO(&fds);
+		FD_SET(conn->sock, &fds);
+
+		ret = select(conn->sock + 1, &fds, NULL, NULL, &tv);
+		if (ret < 0)
+			return -1;
+
+		if (ret == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	xSemaphoreTake(conn->lock, portMAX_DELAY);
+	ret = mbedtls_ssl_read(&conn->ssl, buf, len);
+	xSemaphoreGive(conn->lock);
+
+	if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		/* Only part of a record arrived so far */
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+		return 0;
+
+	return ret < 0 ? -1 : ret;
+}
+
+void tls_free(struct tls_conn *conn)
+{
+	if (!conn)
+		return;
+
+	mbedtls_ssl_free(&conn->ssl);
+	if (conn->lock)
+		vSemaphoreDelete(conn->lock);
+	free(conn);
+}
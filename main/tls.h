@@ -0,0 +1,23 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct tls_conn;
+
+#ifdef CONFIG_BRIDGE_TLS
+bool tls_init(void);
+struct tls_conn *tls_accept(int sock);
+ssize_t tls_send(struct tls_conn *conn, const void *buf, size_t len);
+ssize_t tls_recv(struct tls_conn *conn, void *buf, size_t len);
+void tls_free(struct tls_conn *conn);
+#else
+static inline ssize_t tls_send(struct tls_conn *conn, const void *buf,
+							   size_t len) { return -1; }
+static inline ssize_t tls_recv(struct tls_conn *conn, void *buf,
+							   size_t len) { return -1; }
+static inline void tls_free(struct tls_conn *conn) { }
+#endif
+
+#endif /* __TLS_H__ */
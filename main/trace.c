@@ -0,0 +1,54 @@
+/* Bridge hot path trace
+
+   TRACE() points write fixed size records into a RAM ring: CPU cycle
+   counter, event id, the task that hit it and one argument. GET /trace
+   returns a snapshot of the ring, use trace2json.py to convert it to
+   Chrome trace event JSON for Perfetto or chrome://tracing.
+
+   Dump layout, all fields little endian:
+   - uint32_t magic "TRC1", CPU frequency in Hz, total records written,
+     ring size in records
+   - the ring, in slot order, struct trace_rec each
+*/
+#include <string.h>
+
+#include <sdkconfig.h>
+
+#include "trace.h"
+
+#define TRACE_MAGIC 0x31435254
+
+#ifdef CONFIG_ESP8266_DEFAULT_CPU_FREQ_160
+#define TRACE_CPU_HZ 160000000
+#else
+#define TRACE_CPU_HZ 80000000
+#endif
+
+struct trace_rec g_trace_ring[TRACE_RECORDS];
+uint32_t g_trace_head;
+volatile bool g_trace_frozen;
+
+esp_err_t trace_endpoint(httpd_req_t *req)
+{
+	uint32_t hdr[4] = { TRACE_MAGIC, TRACE_CPU_HZ, 0, TRACE_RECORDS };
+
+	/*
+	 * Stop recording so the ring matches the head in the header, then
+	 * let writers that already reserved a slot fill it in.
+	 */
+	portENTER_CRITICAL();
+	g_trace_frozen = true;
+	hdr[2] = g_trace_head;
+	portEXIT_CRITICAL();
+	vTaskDelay(1);
+
+	httpd_resp_set_type(req, HTTPD_TYPE_OCTET);
+	httpd_resp_send_chunk(req, (const char *)hdr, sizeof(hdr));
+	httpd_resp_send_chunk(req, (const char *)g_trace_ring, sizeof(g_trace_ring));
+
+	g_trace_frozen = false;
+
+	// End response
+	httpd_resp_send_chunk(req, NULL, 0);
+	return ESP_OK;
+}
@@ -0,0 +1,94 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/* Event ids, keep in sync with trace2json.py */
+enum trace_event {
+	TRACE_UART_EVENT = 1,		/* arg: uart_event_type_t */
+	TRACE_UART_READ_BEGIN,
+	TRACE_UART_READ_END,		/* arg: bytes read */
+	TRACE_UART_WRITE_BEGIN,		/* arg: bytes to write */
+	TRACE_UART_WRITE_END,
+	TRACE_SEND_BEGIN,			/* arg: bytes to send */
+	TRACE_SEND_END,				/* arg: bytes sent or error */
+	TRACE_RECV_BEGIN,
+	TRACE_RECV_END,				/* arg: bytes received or error */
+	TRACE_WIFI_EVENT,			/* arg: WiFi event id */
+	TRACE_HTTP_RECV_BEGIN,
+	TRACE_HTTP_RECV_END,		/* arg: bytes received or error */
+	TRACE_OTA_WRITE_BEGIN,		/* arg: bytes to write */
+	TRACE_OTA_WRITE_END,		/* arg: esp_err_t */
+};
+
+#ifdef CONFIG_BRIDGE_TRACE
+
+#include <esp_http_server.h>
+
+#define TRACE_RECORDS CONFIG_BRIDGE_TRACE_RECORDS
+
+#if TRACE_RECORDS & (TRACE_RECORDS - 1)
+#error "CONFIG_BRIDGE_TRACE_RECORDS must be a power of two"
+#endif
+
+struct trace_rec {
+	uint32_t ccount;
+	uint16_t event;
+	uint16_t task;
+	uint32_t arg;
+};
+
+extern struct trace_rec g_trace_ring[TRACE_RECORDS];
+extern uint32_t g_trace_head;
+extern volatile bool g_trace_frozen;
+
+static inline uint32_t trace_ccount(void)
+{
+	uint32_t ccount;
+
+	__asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+	return ccount;
+}
+
+/*
+ * Only the slot reservation and timestamp run with interrupts off, which
+ * keeps records in time order; the record itself is filled in afterwards,
+ * so the ring never blocks a writer. Nothing is recorded while GET /trace
+ * sends the ring.
+ */
+static inline void trace_record(uint16_t event, uint32_t arg)
+{
+	struct trace_rec *rec;
+	uint32_t idx, ccount;
+
+	portENTER_CRITICAL();
+	if (g_trace_frozen) {
+		portEXIT_CRITICAL();
+		return;
+	}
+	idx = g_trace_head++;
+	ccount = trace_ccount();
+	portEXIT_CRITICAL();
+
+	rec = &g_trace_ring[idx & (TRACE_RECORDS - 1)];
+	rec->ccount = ccount;
+	rec->event = event;
+	rec->task = (uintptr_t)xTaskGetCurrentTaskHandle();
+	rec->arg = arg;
+}
+
+esp_err_t trace_endpoint(httpd_req_t *req);
+
+#define TRACE(event, arg) trace_record(event, arg)
+
+#else
+
+#define TRACE(event, arg) do { } while (0)
+
+#endif
+
+#endif /* __TRACE_H__ */
@@ -14,6 +14,7 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 
 #include <esp_system.h>
 #include <esp_wifi.h>
@@ -25,6 +26,9 @@
 #include <lwip/sys.h>
 
 #include "nvm.h"
+#include "wifi.h"
+#include "mem.h"
+#include "roam.h"
 
 /* The examples use WiFi configuration that you can set via project
    configuration menu
@@ -35,25 +39,151 @@
 #define EXAMPLE_ESP_WIFI_SSID CONFIG_ESP_WIFI_SSID
 #define EXAMPLE_ESP_WIFI_PASS CONFIG_ESP_WIFI_PASSWORD
 #define EXAMPLE_ESP_MAXIMUM_RETRY CONFIG_ESP_MAXIMUM_RETRY
+#define WIFI_LISTEN_INTERVAL CONFIG_BRIDGE_PS_LISTEN_INTERVAL
+#define WIFI_APPLY_TIMEOUT_MS 20000
+#define WIFI_START_TIMEOUT_MS 5000
 
 /* The event group allows multiple bits for each event, but we only care about
- * two events:
+ * three events:
  * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
+ * - we failed to connect after the maximum amount of retries
+ * - the station has started and may connect */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT BIT1
+#define WIFI_STARTED_BIT BIT2
 
 
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t g_wifi_events = NULL;
+EVENT_GROUP_DEFINE(g_wifi_events);
 static int g_retry_num = 0;
+static uint32_t g_gateway = 0;
+
+#if defined(CONFIG_BRIDGE_PS_PROFILE_MODEM)
+#define WIFI_DEFAULT_POWER_PROFILE WIFI_POWER_MODEM_SLEEP
+#elif defined(CONFIG_BRIDGE_PS_PROFILE_ADAPTIVE)
+#define WIFI_DEFAULT_POWER_PROFILE WIFI_POWER_ADAPTIVE
+#else
+#define WIFI_DEFAULT_POWER_PROFILE WIFI_POWER_NO_SLEEP
+#endif
+
+static wifi_power_profile_t g_power_profile = WIFI_DEFAULT_POWER_PROFILE;
+static bool g_bridge_active = false;
+static bool g_sta_mode = false;
+static bool g_connect_on_start = true;
+
+/* Live reconfiguration, see wifi_apply_sta() */
+static SemaphoreHandle_t g_apply_start = NULL;
+SEMAPHORE_DEFINE(g_apply_start);
+TASK_DEFINE(apply, BRIDGE_STACK_APPLY);
+static wifi_config_t g_apply_config;
+static volatile bool g_apply_busy = false;
+static char g_apply_status[96] = "idle";
+
+/* Serializes reconfiguration of the station, see wifi_sta_switch() */
+static SemaphoreHandle_t g_sta_lock = NULL;
+SEMAPHORE_DEFINE(g_sta_lock);
+
+static const char *power_profile_names[] = {
+	[WIFI_POWER_NO_SLEEP] = "none",
+	[WIFI_POWER_MODEM_SLEEP] = "modem",
+	[WIFI_POWER_ADAPTIVE] = "adaptive",
+};
+
+const char *wifi_power_profile_name(wifi_power_profile_t profile)
+{
+	if (profile >= WIFI_POWER_MAX)
+		return "unknown";
+
+	return power_profile_names[profile];
+}
+
+bool wifi_power_profile_parse(const char *name, wifi_power_profile_t *profile)
+{
+	for (int i = 0; i < WIFI_POWER_MAX; i++) {
+		if (strcmp(name, power_profile_names[i]) == 0) {
+			*profile = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Sleep only if the profile allows it and, for the adaptive profile, there
+ * is no bridge client waiting for an answer. */
+static void wifi_apply_power_save(void)
+{
+	wifi_ps_type_t ps;
+
+	if (!g_sta_mode)
+		return;
+
+	switch (g_power_profile) {
+	case WIFI_POWER_MODEM_SLEEP:
+		ps = WIFI_PS_MAX_MODEM;
+		break;
+	case WIFI_POWER_ADAPTIVE:
+		ps = g_bridge_active ? WIFI_PS_NONE : WIFI_PS_MAX_MODEM;
+		break;
+	default:
+		ps = WIFI_PS_NONE;
+		break;
+	}
+
+	esp_wifi_set_ps(ps);
+}
+
+wifi_power_profile_t wifi_get_power_profile(void)
+{
+	return g_power_profile;
+}
+
+bool wifi_set_power_profile(wifi_power_profile_t profile)
+{
+	uint8_t val = profile;
+
+	if (profile >= WIFI_POWER_MAX)
+		return false;
+
+	g_power_profile = profile;
+	wifi_apply_power_save();
+
+	return nvm_write_key("power", &val, sizeof(val));
+}
+
+void wifi_bridge_active(bool active)
+{
+	g_bridge_active = active;
+
+	if (g_power_profile == WIFI_POWER_ADAPTIVE)
+		wifi_apply_power_save();
+}
+
+bool wifi_get_gateway(uint32_t *addr)
+{
+	*addr = g_gateway;
+	return g_gateway != 0;
+}
+
+static void wifi_load_power_profile(void)
+{
+	uint8_t val;
+	size_t len = sizeof(val);
+
+	if (nvm_read_key("power", &val, &len) && val < WIFI_POWER_MAX)
+		g_power_profile = val;
+}
 
 static void wifi_sta_events(void *arg, esp_event_base_t event_base,
 							int32_t event_id, void *event_data)
 {
 	switch (event_id) {
 	case WIFI_EVENT_STA_START:
-		esp_wifi_connect();
+		/* With stored networks the first connect follows a scan */
+		if (g_connect_on_start)
+			esp_wifi_connect();
+		xEventGroupSetBits(g_wifi_events, WIFI_STARTED_BIT);
 		break;
 
 	case WIFI_EVENT_STA_DISCONNECTED:
@@ -62,6 +192,7 @@ static void wifi_sta_events(void *arg, esp_event_base_t event_base,
 			g_retry_num++;
 		} else {
 			xEventGroupSetBits(g_wifi_events, WIFI_FAIL_BIT);
+			roam_lost();
 		}
 		break;
 	default:
@@ -73,23 +204,53 @@ static void wifi_sta_ip_events(void *arg, esp_event_base_t event_base,
 							   int32_t event_id, void *event_data)
 {
 	switch (event_id) {
-	case IP_EVENT_STA_GOT_IP:
+	case IP_EVENT_STA_GOT_IP: {
+		ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+
+		g_gateway = event->ip_info.gw.addr;
 		g_retry_num = 0;
+		mem_sample_heap();
+		roam_connected();
 		xEventGroupSetBits(g_wifi_events, WIFI_CONNECTED_BIT);
 		break;
+	}
 	default:
 		break;
 	}
 }
 
+static bool wifi_sta_try(wifi_config_t *config, bool connected);
+
+/* Connect to the last used stored network, or the best one in range */
+static bool wifi_roam_connect(void)
+{
+	wifi_config_t config;
+	int i, n;
+
+	if (roam_last(&config) && wifi_sta_try(&config, false))
+		return true;
+
+	n = roam_scan();
+	for (i = 0; i < n; i++) {
+		roam_candidate(i, &config);
+		if (wifi_sta_try(&config, false))
+			return true;
+	}
+
+	return false;
+}
+
 bool wifi_start_sta_and_connect(void)
 {
 	uint8_t ssid[MAX_SSID_LEN], password[MAX_PASSPHRASE_LEN];
+	EventBits_t bits;
 	size_t len;
 	bool ok;
 
 	if (!g_wifi_events)
-		g_wifi_events = xEventGroupCreate();
+		g_wifi_events = event_group_create(g_wifi_events);
+	if (!g_sta_lock)
+		g_sta_lock = mutex_create(g_sta_lock);
 
 	esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_sta_events,
 							   NULL);
@@ -100,10 +261,15 @@ bool wifi_start_sta_and_connect(void)
 		.sta = {
 			.ssid = EXAMPLE_ESP_WIFI_SSID,
 			.password = EXAMPLE_ESP_WIFI_PASS,
+			.listen_interval = WIFI_LISTEN_INTERVAL,
 			.threshold.authmode = WIFI_AUTH_WPA2_PSK
 		}
 	};
 
+	wifi_load_power_profile();
+	roam_init();
+	g_connect_on_start = !roam_networks();
+
 	esp_wifi_set_storage(WIFI_STORAGE_FLASH);
 	esp_wifi_set_mode(WIFI_MODE_STA);
 
@@ -125,20 +291,40 @@ bool wifi_start_sta_and_connect(void)
 	esp_wifi_set_config(ESP_IF_WIFI_STA, &config);
 	esp_wifi_start();
 
+	g_sta_mode = true;
+	wifi_apply_power_save();
+
+	if (!g_connect_on_start) {
+		/* Connecting before STA_START fails */
+		bits = xEventGroupWaitBits(g_wifi_events, WIFI_STARTED_BIT, pdFALSE,
+								   pdFALSE,
+								   WIFI_START_TIMEOUT_MS / portTICK_PERIOD_MS);
+		if ((bits & WIFI_STARTED_BIT) && wifi_roam_connect()) {
+			roam_start();
+			return true;
+		}
+		goto fail;
+	}
+
 	/* Waiting until either the connection is established (WIFI_CONNECTED_BIT)
 	 * or connection failed for the maximum number of re-tries (WIFI_FAIL_BIT).
 	 * The bits are set by event_handler() (see above) */
-	EventBits_t bits = xEventGroupWaitBits(g_wifi_events,
-										   WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-										   pdFALSE, pdFALSE, portMAX_DELAY);
+	bits = xEventGroupWaitBits(g_wifi_events,
+							   WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
+							   pdFALSE, pdFALSE, portMAX_DELAY);
 
-	if (bits & WIFI_CONNECTED_BIT)
+	if (bits & WIFI_CONNECTED_BIT) {
+		roam_start();
 		return true;
+	}
 
+fail:
+	g_sta_mode = false;
 	esp_wifi_stop();
 	esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_sta_events);
 	esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_sta_ip_events);
-	xEventGroupClearBits(g_wifi_events, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+	xEventGroupClearBits(g_wifi_events, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT |
+						 WIFI_STARTED_BIT);
 	return false;
 }
 
@@ -199,3 +385,177 @@ void wifi_stop_ap(void)
 	esp_wifi_stop();
 	esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_ap_events);
 }
+
+void wifi_sta_config_init(wifi_config_t *config, const char *ssid,
+						  const char *password)
+{
+	memset(config, 0, sizeof(*config));
+	memcpy(config->sta.ssid, ssid, MIN(strlen(ssid), sizeof(config->sta.ssid)));
+	/* WiFi stack expect '\0' terminated string */
+	memcpy(config->sta.password, password,
+		   MIN(strlen(password), sizeof(config->sta.password) - 1));
+	config->sta.listen_interval = WIFI_LISTEN_INTERVAL;
+	config->sta.threshold.authmode = *password ? WIFI_AUTH_WPA2_PSK :
+												 WIFI_AUTH_OPEN;
+}
+
+/* Connect with the given configuration and wait for an IP address */
+static bool wifi_sta_try(wifi_config_t *config, bool connected)
+{
+	EventBits_t bits;
+
+	g_retry_num = 0;
+	xEventGroupClearBits(g_wifi_events, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+
+	esp_wifi_set_config(ESP_IF_WIFI_STA, config);
+
+	/* The disconnect event handler connects again with the new config */
+	if (connected)
+		esp_wifi_disconnect();
+	else
+		esp_wifi_connect();
+
+	bits = xEventGroupWaitBits(g_wifi_events,
+							   WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE,
+							   pdFALSE, WIFI_APPLY_TIMEOUT_MS / portTICK_PERIOD_MS);
+
+	return bits & WIFI_CONNECTED_BIT;
+}
+
+static void wifi_apply_task(void *arg)
+{
+	wifi_config_t old;
+	EventBits_t bits;
+	bool from_ap, ok;
+
+	for (;;) {
+
+		xSemaphoreTake(g_apply_start, portMAX_DELAY);
+		xSemaphoreTake(g_sta_lock, portMAX_DELAY);
+
+		from_ap = !g_sta_mode;
+
+		if (from_ap) {
+			/* Keep the AP up during the trial so we can fall back to it */
+			esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+									   &wifi_sta_events, NULL);
+			esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
+									   &wifi_sta_ip_events, NULL);
+			xEventGroupClearBits(g_wifi_events, WIFI_STARTED_BIT);
+			esp_wifi_set_mode(WIFI_MODE_APSTA);
+
+			/* As at boot, connecting before STA_START fails */
+			bits = xEventGroupWaitBits(g_wifi_events, WIFI_STARTED_BIT,
+									   pdFALSE, pdFALSE,
+									   WIFI_START_TIMEOUT_MS / portTICK_PERIOD_MS);
+			ok = bits & WIFI_STARTED_BIT;
+		} else {
+			esp_wifi_get_config(ESP_IF_WIFI_STA, &old);
+			ok = true;
+		}
+
+		if (ok)
+			ok = wifi_sta_try(&g_apply_config, !from_ap);
+
+		if (ok) {
+			nvm_write_key("ssid", g_apply_config.sta.ssid,
+						  strnlen((char *)g_apply_config.sta.ssid,
+								  sizeof(g_apply_config.sta.ssid)));
+			nvm_write_key("password", g_apply_config.sta.password,
+						  strlen((char *)g_apply_config.sta.password));
+			roam_remember((char *)g_apply_config.sta.ssid,
+						  (char *)g_apply_config.sta.password);
+
+			if (from_ap) {
+				esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID,
+											 &wifi_ap_events);
+				esp_wifi_set_mode(WIFI_MODE_STA);
+				g_sta_mode = true;
+				wifi_apply_power_save();
+				roam_start();
+			}
+
+			snprintf(g_apply_status, sizeof(g_apply_status), "applied %.32s\n",
+					 (char *)g_apply_config.sta.ssid);
+		} else if (from_ap) {
+			esp_wifi_disconnect();
+			esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID,
+										 &wifi_sta_events);
+			esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP,
+										 &wifi_sta_ip_events);
+			esp_wifi_set_mode(WIFI_MODE_AP);
+
+			snprintf(g_apply_status, sizeof(g_apply_status),
+					 "failed %.32s, staying in AP mode\n",
+					 (char *)g_apply_config.sta.ssid);
+		} else {
+			ok = wifi_sta_try(&old, false);
+			snprintf(g_apply_status, sizeof(g_apply_status),
+					 "failed %.32s, %s %.32s\n", (char *)g_apply_config.sta.ssid,
+					 ok ? "restored" : "can't restore", (char *)old.sta.ssid);
+		}
+
+		xSemaphoreGive(g_sta_lock);
+		g_apply_busy = false;
+	}
+}
+
+/*
+ * Switch the station to a new network without a reboot. The new network
+ * is tried first; only if it gives us an IP address it's stored in NVM,
+ * otherwise the previous network, or AP mode, is restored. Runs in the
+ * background because the caller may lose its connection in the process.
+ */
+bool wifi_apply_sta(const char *ssid, const char *password)
+{
+	if (g_apply_busy)
+		return false;
+
+	if (!g_apply_start) {
+		g_apply_start = binary_create(g_apply_start);
+		task_create(apply, wifi_apply_task, "wifi_apply", NULL, 2);
+	}
+
+	g_apply_busy = true;
+	wifi_sta_config_init(&g_apply_config, ssid, password);
+	snprintf(g_apply_status, sizeof(g_apply_status), "applying %.32s\n", ssid);
+
+	xSemaphoreGive(g_apply_start);
+	return true;
+}
+
+/* Whether the station is up and free to be moved to another network */
+bool wifi_sta_roaming(void)
+{
+	return g_sta_mode && !g_apply_busy;
+}
+
+/* The station gave up reconnecting to its AP */
+bool wifi_sta_lost(void)
+{
+	return xEventGroupGetBits(g_wifi_events) & WIFI_FAIL_BIT;
+}
+
+/*
+ * Move the station to another network, for roaming. Unlike
+ * wifi_apply_sta() nothing is stored and the caller restores the
+ * previous network itself. Fails right away while a reconfiguration is
+ * in progress.
+ */
+bool wifi_sta_switch(wifi_config_t *config)
+{
+	wifi_ap_record_t ap;
+	bool ok;
+
+	if (!wifi_sta_roaming() || !xSemaphoreTake(g_sta_lock, 0))
+		return false;
+
+	ok = wifi_sta_try(config, esp_wifi_sta_get_ap_info(&ap) == ESP_OK);
+	xSemaphoreGive(g_sta_lock);
+	return ok;
+}
+
+const char *wifi_apply_status(void)
+{
+	return g_apply_status;
+}
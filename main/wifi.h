@@ -1,7 +1,33 @@
 #ifndef __WIFI_H__
 #define __WIFI_H__
 
+#include <esp_wifi_types.h>
+
+/* Station power save profiles, persisted in NVM. */
+typedef enum {
+	WIFI_POWER_NO_SLEEP,	/* Radio always on, lowest latency */
+	WIFI_POWER_MODEM_SLEEP,	/* Modem sleep, wake every listen interval */
+	WIFI_POWER_ADAPTIVE,	/* No sleep while a bridge client is connected */
+	WIFI_POWER_MAX
+} wifi_power_profile_t;
+
 bool wifi_start_sta_and_connect(void);
 void wifi_start_ap(void);
 
+const char *wifi_power_profile_name(wifi_power_profile_t profile);
+bool wifi_power_profile_parse(const char *name, wifi_power_profile_t *profile);
+wifi_power_profile_t wifi_get_power_profile(void);
+bool wifi_set_power_profile(wifi_power_profile_t profile);
+void wifi_bridge_active(bool active);
+bool wifi_get_gateway(uint32_t *addr);
+
+bool wifi_apply_sta(const char *ssid, const char *password);
+const char *wifi_apply_status(void);
+
+void wifi_sta_config_init(wifi_config_t *config, const char *ssid,
+						  const char *password);
+bool wifi_sta_roaming(void);
+bool wifi_sta_lost(void);
+bool wifi_sta_switch(wifi_config_t *config);
+
 #endif /* __WIFI_H__ */
\ No newline at end of file
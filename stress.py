@@ -0,0 +1,372 @@
+#!/usr/bin/env python3
+#
+# Stress test of the bridge data path from a Linux host. Needs a build
+# with "Enable fault injection".
+#
+# The device, or the host through the UART, sends checksummed pattern
+# frames (see main/fault.c) and every bridge connection is checked byte
+# for byte: frames must be intact, in order and gapless within a
+# connection and never duplicated. Frames that didn't arrive are then
+# reconciled against the byte and drop counters in GET /stats.
+#
+#   $ ./stress.py ${wifi_uart_ip} pattern --frames 200000
+#   $ ./stress.py ${wifi_uart_ip} stall --stall 50 --slow 0.01
+#   $ ./stress.py ${wifi_uart_ip} rst --every 2
+#   $ ./stress.py ${wifi_uart_ip} storm --storm 200 --churn 2
+#   $ ./stress.py ${wifi_uart_ip} uart --tty /dev/ttyUSB0 --baud 115200
+#
+# pattern  device generated frames at full speed, nothing may be lost
+# stall    sends delayed on the device and a slow reader on the host,
+#          the UART task blocks but nothing may be lost
+# rst      the client is reset mid-stream every few seconds and reconnects
+# storm    the device resets the client every few ms, the host reconnects
+#          at once and extra clients keep taking the connection over
+# uart     the host writes frames to the UART at line rate, losses must
+#          show up in the overflow counters
+
+import argparse
+import os
+import re
+import socket
+import struct
+import sys
+import termios
+import threading
+import time
+import urllib.request
+
+PORT = 8888
+FRAME = 16
+WORDS = struct.Struct('<4I')
+MASK = 0xffffffff
+
+
+def frame(seq):
+    w1 = seq ^ 0x5a5a5a5a
+    w2 = (seq * 2654435761) & MASK
+    return WORDS.pack(seq, w1, w2, (seq + w1 + w2) & MASK)
+
+
+def valid(data, offs):
+    seq, w1, w2, csum = WORDS.unpack_from(data, offs)
+    return (w1 == seq ^ 0x5a5a5a5a and w2 == (seq * 2654435761) & MASK and
+            csum == (seq + w1 + w2) & MASK), seq
+
+
+class Checker:
+    """Checks the frames of all connections, shared by the readers"""
+
+    def __init__(self, resync):
+        self.lock = threading.Lock()
+        self.resync = resync
+        self.seen = set()
+        self.bytes = 0
+        self.conns = 0
+        self.corrupt = 0
+        self.gaps = 0
+        self.dups = 0
+        self.partial = 0
+        self.partial_bytes = 0
+        self.last_rx = time.monotonic()
+
+    def connection(self):
+        return Stream(self)
+
+
+class Stream:
+    """Frames of one connection"""
+
+    def __init__(self, checker):
+        self.c = checker
+        self.buf = bytearray()
+        self.next = None
+
+        with checker.lock:
+            checker.conns += 1
+
+    def feed(self, data):
+        c = self.c
+        self.buf += data
+        offs = 0
+
+        with c.lock:
+            c.bytes += len(data)
+            c.last_rx = time.monotonic()
+
+            while len(self.buf) - offs >= FRAME:
+                ok, seq = valid(self.buf, offs)
+                if not ok:
+                    c.corrupt += 1
+                    # UART losses cut frames anywhere, find the next one
+                    offs += 1 if c.resync else FRAME
+                    self.next = None
+                    continue
+
+                if seq in c.seen:
+                    c.dups += 1
+                c.seen.add(seq)
+
+                if self.next is not None and seq != self.next:
+                    c.gaps += 1
+                self.next = seq + 1
+                offs += FRAME
+
+        del self.buf[:offs]
+
+    def close(self):
+        if self.buf:
+            with self.c.lock:
+                self.c.partial += 1
+                self.c.partial_bytes += len(self.buf)
+
+
+class Reader(threading.Thread):
+    """Reads the bridge port, reconnecting until stopped"""
+
+    def __init__(self, host, checker, stop, slow=0, hold=None):
+        super().__init__(daemon=True)
+        self.host = host
+        self.checker = checker
+        self.stop = stop
+        self.slow = slow
+        self.hold = hold
+
+    def session(self):
+        sock = socket.create_connection((self.host, PORT), timeout=5)
+        sock.settimeout(0.5)
+        stream = self.checker.connection()
+        end = time.monotonic() + self.hold if self.hold else None
+
+        try:
+            while not self.stop.is_set():
+                if end and time.monotonic() > end:
+                    break
+                try:
+                    data = sock.recv(4096)
+                except socket.timeout:
+                    continue
+                if not data:
+                    break
+                stream.feed(data)
+                if self.slow:
+                    time.sleep(self.slow)
+        except OSError:
+            pass
+        finally:
+            stream.close()
+            sock.close()
+
+    def run(self):
+        while not self.stop.is_set():
+            try:
+                self.session()
+            except OSError:
+                time.sleep(0.1)
+
+
+def http(host, path, body=None):
+    data = body.encode() if body is not None else None
+    with urllib.request.urlopen('http://%s%s' % (host, path), data,
+                                timeout=10) as resp:
+        return resp.read().decode()
+
+
+def fault(host, cmd):
+    resp = http(host, '/fault', cmd)
+    if resp.strip() != 'OK':
+        sys.exit('POST /fault %s: %s' % (cmd, resp.strip()))
+
+
+STATS = {
+    'uart_rx': r'UART rx (\d+)',
+    'wifi_tx': r'WiFi tx (\d+)',
+    'no_client': r'Dropped no client (\d+)',
+    'send': r'Dropped no client \d+, send (\d+)',
+    'overflow': r'send \d+, overflow (\d+)',
+    'fifo_ovf': r'FIFO overflow (\d+)',
+}
+
+
+def stats(host):
+    text = http(host, '/stats')
+    return {k: int(re.search(p, text).group(1)) for k, p in STATS.items()}
+
+
+def delta(before, after):
+    return {k: (after[k] - before[k]) & MASK for k in before}
+
+
+def open_tty(path, baud):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    attr = termios.tcgetattr(fd)
+    speed = getattr(termios, 'B%d' % baud)
+    attr[0] = attr[1] = attr[3] = 0
+    attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+    attr[4] = attr[5] = speed
+    termios.tcsetattr(fd, termios.TCSANOW, attr)
+    return fd
+
+
+def uart_writer(fd, frames, baud):
+    # 10 bits per byte, write in chunks paced to the line rate
+    chunk = 64
+    start = time.monotonic()
+
+    for seq in range(0, frames, chunk):
+        data = b''.join(frame(s) for s in range(seq, min(seq + chunk, frames)))
+        os.write(fd, data)
+        ahead = (seq + chunk) * FRAME * 10 / baud - (time.monotonic() - start)
+        if ahead > 0:
+            time.sleep(ahead)
+
+    termios.tcdrain(fd)
+
+
+def wait_done(host, before, total, checker, quiet):
+    """Until the device accounted for all bytes and the readers caught up"""
+    while True:
+        time.sleep(0.5)
+        d = delta(before, stats(host))
+        if d['wifi_tx'] + d['send'] >= total and \
+           time.monotonic() - checker.last_rx > quiet:
+            return d
+        if time.monotonic() - checker.last_rx > 30:
+            print('no data for 30 s, giving up')
+            return d
+
+
+def run(args):
+    host = args.host
+    uart = args.mode == 'uart'
+    checker = Checker(resync=uart)
+    stop = threading.Event()
+
+    fault(host, 'off')
+    readers = [Reader(host, checker, stop, slow=args.slow)]
+
+    # Churn clients take the connection over, then give it back
+    for _ in range(args.churn):
+        readers.append(Reader(host, checker, stop, hold=0.05))
+
+    for r in readers:
+        r.start()
+    time.sleep(1)
+
+    before = stats(host)
+    total = args.frames * FRAME
+
+    if args.mode == 'stall':
+        fault(host, 'stall=%d' % args.stall)
+    elif args.mode == 'storm':
+        fault(host, 'storm=%d' % args.storm)
+
+    start = time.monotonic()
+    if uart:
+        fd = open_tty(args.tty, args.baud)
+        uart_writer(fd, args.frames, args.baud)
+        os.close(fd)
+    else:
+        fault(host, 'pattern=%d' % args.frames)
+
+    # Mid-stream resets while the pattern runs
+    while args.mode == 'rst' and not uart:
+        time.sleep(args.every)
+        d = delta(before, stats(host))
+        if d['wifi_tx'] + d['send'] >= total:
+            break
+        fault(host, 'rst')
+
+    if uart:
+        time.sleep(2)
+        d = delta(before, stats(host))
+    else:
+        d = wait_done(host, before, total, checker, 2)
+
+    elapsed = time.monotonic() - start
+    fault(host, 'off')
+    stop.set()
+    for r in readers:
+        r.join()
+
+    return check(args, checker, d, total, elapsed)
+
+
+def check(args, c, d, total, elapsed):
+    received = len(c.seen)
+    lost = args.frames - received
+    # Sent by the device, but gone with a reset connection
+    in_flight = d['wifi_tx'] - c.bytes
+    failed = []
+
+    print('%d connections, %d of %d frames in %.1f s, %.0f kB/s' %
+          (c.conns, received, args.frames, elapsed,
+           c.bytes / elapsed / 1000))
+    print('stats: uart rx %d, wifi tx %d, dropped send %d, no client %d, '
+          'overflow %d, FIFO overflow %d' %
+          (d['uart_rx'], d['wifi_tx'], d['send'], d['no_client'],
+           d['overflow'], d['fifo_ovf']))
+    # Every lost byte is a send drop, in flight or in a cut off frame
+    print('lost %d frames: dropped send %d, in flight on reset %d, '
+          'partial frames %d bytes' %
+          (lost, d['send'], in_flight, c.partial_bytes))
+    print('corrupt %d, gaps %d, duplicates %d' % (c.corrupt, c.gaps, c.dups))
+
+    if c.dups:
+        failed.append('duplicated frames')
+    if c.bytes > d['wifi_tx']:
+        failed.append('received more than the device sent')
+
+    if args.mode == 'uart':
+        # Frames are cut wherever the ring buffer was flushed
+        if lost and not (d['overflow'] or d['no_client'] or d['send']):
+            failed.append('frames lost without a drop counted')
+        # Bytes lost in a FIFO overflow aren't counted by the device
+        if not d['fifo_ovf'] and \
+           d['uart_rx'] + d['overflow'] + d['no_client'] < total:
+            failed.append('UART bytes unaccounted for')
+    else:
+        if c.corrupt or c.gaps:
+            failed.append('corrupt or missing frames within a connection')
+        if d['wifi_tx'] + d['send'] != total:
+            failed.append('sent and dropped bytes %d, expected %d' %
+                          (d['wifi_tx'] + d['send'], total))
+        resets = args.mode in ('rst', 'storm') or args.churn
+        if in_flight and not resets:
+            failed.append('%d sent bytes never arrived' % in_flight)
+
+    for f in failed:
+        print('FAIL:', f)
+    if not failed:
+        print('PASS')
+    return 1 if failed else 0
+
+
+def main():
+    p = argparse.ArgumentParser(description='bridge data path stress test')
+    p.add_argument('host')
+    p.add_argument('mode', choices=['pattern', 'stall', 'rst', 'storm', 'uart'])
+    p.add_argument('--frames', type=int, default=100000)
+    p.add_argument('--stall', type=int, default=50,
+                   help='device send delay in ms')
+    p.add_argument('--slow', type=float, default=0,
+                   help='host delay after every read in s')
+    p.add_argument('--every', type=float, default=2,
+                   help='seconds between resets in rst mode')
+    p.add_argument('--storm', type=int, default=200,
+                   help='ms between device resets in storm mode')
+    p.add_argument('--churn', type=int, default=0,
+                   help='extra clients taking the connection over')
+    p.add_argument('--tty', help='serial port wired to the device UART')
+    p.add_argument('--baud', type=int, default=115200)
+    args = p.parse_args()
+
+    if args.mode == 'uart' and not args.tty:
+        p.error('uart mode needs --tty')
+    if args.mode == 'stall' and not args.slow:
+        args.slow = 0.01
+
+    sys.exit(run(args))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+#
+# Convert a GET /trace dump into Chrome trace event JSON, which can be
+# loaded into https://ui.perfetto.dev or chrome://tracing.
+#
+#   $ curl -s ${wifi_uart_ip}/trace -o trace.bin
+#   $ ./trace2json.py trace.bin > trace.json
+
+import json
+import struct
+import sys
+
+MAGIC = 0x31435254
+HEADER = struct.Struct('<4I')
+RECORD = struct.Struct('<IHHi')
+
+# Event id: (name, phase), keep in sync with main/trace.h
+EVENTS = {
+    1: ('uart_event', 'i'),
+    2: ('uart_read_bytes', 'B'),
+    3: ('uart_read_bytes', 'E'),
+    4: ('uart_write_bytes', 'B'),
+    5: ('uart_write_bytes', 'E'),
+    6: ('send', 'B'),
+    7: ('send', 'E'),
+    8: ('recv', 'B'),
+    9: ('recv', 'E'),
+    10: ('wifi_event', 'i'),
+    11: ('httpd_req_recv', 'B'),
+    12: ('httpd_req_recv', 'E'),
+    13: ('esp_ota_write', 'B'),
+    14: ('esp_ota_write', 'E'),
+}
+
+
+def records(data):
+    magic, cpu_hz, head, size = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        sys.exit('not a trace dump')
+
+    ring = [RECORD.unpack_from(data, HEADER.size + i * RECORD.size)
+            for i in range(size)]
+
+    # Oldest record first, head is the next slot to be written
+    first = max(0, head - size)
+    return cpu_hz, [ring[i % size] for i in range(first, head)]
+
+
+def convert(data):
+    cpu_hz, recs = records(data)
+    events = []
+    prev = None
+    wraps = 0
+
+    for ccount, event, task, arg in recs:
+        # The cycle counter wraps every 2^32 cycles
+        if prev is not None and ccount < prev:
+            wraps += 1
+        prev = ccount
+
+        name, phase = EVENTS.get(event, ('event %d' % event, 'i'))
+        cycles = (wraps << 32) + ccount
+        ev = {
+            'name': name,
+            'ph': phase,
+            'ts': cycles * 1e6 / cpu_hz,
+            'pid': 0,
+            'tid': task,
+            'args': {'arg': arg},
+        }
+        if phase == 'i':
+            ev['s'] = 't'
+        events.append(ev)
+
+    return {'traceEvents': events, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('usage: %s trace.bin' % sys.argv[0])
+
+    with open(sys.argv[1], 'rb') as f:
+        json.dump(convert(f.read()), sys.stdout, indent=1)
+
+
+if __name__ == '__main__':
+    main()